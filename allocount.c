@@ -0,0 +1,40 @@
+// Counts the heap allocations of a program, for the benchmarks. Preloaded using LD_PRELOAD, glibc only.
+// The count is written to the file named by ALLOCOUNT_FILE when the program exits.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static atomic_ulong g_allocations;
+
+void* malloc(size_t size){
+  atomic_fetch_add_explicit(&g_allocations, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size){
+  atomic_fetch_add_explicit(&g_allocations, 1, memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size){
+  atomic_fetch_add_explicit(&g_allocations, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor))
+static void report(void){
+  const char* path = getenv("ALLOCOUNT_FILE");
+  if(!path)
+    return;
+  FILE* file = fopen(path, "w");
+  if(!file)
+    return;
+  fprintf(file, "%lu\n", (unsigned long)atomic_load(&g_allocations));
+  fclose(file);
+}
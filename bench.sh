@@ -0,0 +1,97 @@
+#!/bin/sh
+# Round trip benchmark. Encodes a random payload with d2s, decodes it again with s2d, and reports
+# the throughput of both. Each configuration is run several times, the fastest run counts.
+# Results are appended to the results file as one JSON object per line.
+
+set -e
+
+BIN=${BIN:-build/release}
+size=1000000
+samples=20
+runs=3
+d2s_flags=
+s2d_flags=
+results=build/bench.json
+
+usage(){
+  cat >&2 <<USAGE
+usage: $0 [-s bytes] [-n samples] [-r runs] [-e d2s-flags] [-d s2d-flags] [-o results]
+  -s  payload size, defaults to $size bytes
+  -n  samples per symbol, defaults to $samples
+  -r  runs per tool, defaults to $runs
+  -e  additional flags for d2s
+  -d  additional flags for s2d
+  -o  file the results are appended to, defaults to $results
+USAGE
+  exit 1
+}
+
+while getopts s:n:r:e:d:o: opt
+do
+  case $opt in
+    s) size=$OPTARG ;;
+    n) samples=$OPTARG ;;
+    r) runs=$OPTARG ;;
+    e) d2s_flags=$OPTARG ;;
+    d) s2d_flags=$OPTARG ;;
+    o) results=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+head -c "$size" /dev/urandom > "$work/payload"
+
+now(){ date +%s%N; }
+
+# Runs a command $runs times, and prints the shortest time it took in ns
+best(){
+  best=
+  for run in $(seq "$runs")
+  do
+    start=$(now)
+    "$@"
+    time=$(($(now) - start))
+    if [ -z "$best" ] || [ "$time" -lt "$best" ]
+      then best=$time
+    fi
+  done
+  echo "$best"
+}
+
+encode(){ LD_PRELOAD=$BIN/allocount.so ALLOCOUNT_FILE=$work/encode.allocations "$BIN/d2s" -n "$samples" $d2s_flags < "$work/payload" > "$work/signal.wav"; }
+decode(){ LD_PRELOAD=$BIN/allocount.so ALLOCOUNT_FILE=$work/decode.allocations "$BIN/s2d" $s2d_flags "$work/signal.wav" > "$work/decoded"; }
+
+encode_ns=$(best encode)
+decode_ns=$(best decode)
+
+ok=true
+cmp -s "$work/payload" "$work/decoded" || ok=false
+
+# d2s writes to a file here, so its header has the JUNK chunk reserved for RF64 in front of fmt, and the real sizes.
+# The sample size is the block align field of the fmt chunk.
+sample_size=$(od -An -tu2 -j68 -N2 "$work/signal.wav" | tr -d ' ')
+data_size=$(od -An -tu4 -j76 -N4 "$work/signal.wav" | tr -d ' ')
+sample_count=$((data_size / sample_size))
+symbols=$((sample_count / samples))
+
+mkdir -p "$(dirname "$results")"
+awk -v time="$(date -u +%Y-%m-%dT%H:%M:%SZ)" -v commit="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)" \
+    -v size="$size" -v samples="$samples" -v symbols="$symbols" -v sample_count="$sample_count" \
+    -v encode_ns="$encode_ns" -v decode_ns="$decode_ns" \
+    -v encode_allocations="$(cat "$work/encode.allocations")" -v decode_allocations="$(cat "$work/decode.allocations")" \
+    -v d2s_flags="$d2s_flags" -v s2d_flags="$s2d_flags" -v ok="$ok" -v results="$results" '
+BEGIN {
+  encode_rate = size / (encode_ns / 1e9)
+  decode_rate = sample_count / (decode_ns / 1e9)
+  printf "encode: %10.2f MB/s  %8.1f ns/symbol  %d allocations\n", encode_rate / 1e6, encode_ns / symbols, encode_allocations
+  printf "decode: %10.2f MS/s  %8.1f ns/symbol  %d allocations\n", decode_rate / 1e6, decode_ns / symbols, decode_allocations
+  if(ok != "true")
+    print "error: decoded data differs from the payload"
+  printf "{\"time\":\"%s\",\"commit\":\"%s\",\"d2s_flags\":\"%s\",\"s2d_flags\":\"%s\",\"size\":%d,\"symbol_samples\":%d,\"symbols\":%d,\"samples\":%d,", time, commit, d2s_flags, s2d_flags, size, samples, symbols, sample_count >> results
+  printf "\"encode_ns\":%d,\"encode_bytes_per_s\":%.0f,\"encode_ns_per_symbol\":%.2f,\"encode_allocations\":%d,", encode_ns, encode_rate, encode_ns / symbols, encode_allocations >> results
+  printf "\"decode_ns\":%d,\"decode_samples_per_s\":%.0f,\"decode_ns_per_symbol\":%.2f,\"decode_allocations\":%d,\"ok\":%s}\n", decode_ns, decode_rate, decode_ns / symbols, decode_allocations, ok >> results
+}'
+
+[ "$ok" = true ]
@@ -0,0 +1,99 @@
+// Simulates a channel for the round trip checks, see check.sh. Takes a 16bit WAV stream from d2s on stdin,
+// scales its samples, adds Gaussian noise and puts some silence in front, and writes it to stdout.
+// Optionally, it drops a few samples somewhere in the middle, like a recording that slipped.
+// The noise is the same on every run.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.141592653589793
+#endif
+
+static uint64_t g_random = 0x9E3779B97F4A7C15u;
+
+// xorshift64*, uniform in (0, 1]
+static double uniform(void){
+  g_random ^= g_random >> 12;
+  g_random ^= g_random << 25;
+  g_random ^= g_random >> 27;
+  return ((g_random * 0x2545F4914F6CDD1Du >> 11) + 1) * 0x1p-53;
+}
+
+// Box-Muller, standard normal
+static double gaussian(void){
+  return sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform());
+}
+
+static uint32_t read_le32(const unsigned char p[4]){
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int16_t saturate(double x){
+  return x > INT16_MAX ? INT16_MAX : x < INT16_MIN ? INT16_MIN : lround(x);
+}
+
+static void write_sample(int16_t x){
+  const unsigned char p[2] = {(uint16_t)x & 0xFF, (uint16_t)x >> 8};
+  fwrite(p, 1, 2, stdout);
+}
+
+int main(int argc, char* argv[]){
+  char* end[5] = {"", "", "", "", ""};
+  const bool valid = argc == 4 || argc == 6;
+  const double gain = valid ? strtod(argv[1], &end[0]) : 0;
+  const double noise = valid ? strtod(argv[2], &end[1]) : 0;
+  const long delay = valid ? strtol(argv[3], &end[2], 10) : 0;
+  const long slip_at = argc == 6 ? strtol(argv[4], &end[3], 10) : -1;
+  const long slip = argc == 6 ? strtol(argv[5], &end[4], 10) : 0;
+  if(!valid || *end[0] || *end[1] || *end[2] || *end[3] || *end[4] || noise < 0 || delay < 0 || slip < 0){
+    fprintf(stderr, "usage: %s gain noise delay [at count] < in.wav > out.wav\n", argv[0]);
+    fprintf(stderr, "  noise is the standard deviation, in steps of the samples, delay the samples of silence in front\n");
+    fprintf(stderr, "  at and count drop count samples of the input, after the first at of them\n");
+    return 1;
+  }
+  // Copy the header up to the data chunk, whose size stays the placeholder of a stream
+  unsigned char header[12];
+  if(fread(header, 1, 12, stdin) != 12 || memcmp(header, "RIFF", 4) || memcmp(header+8, "WAVE", 4)){
+    fprintf(stderr, "%s: not a RIFF/WAVE stream\n", argv[0]);
+    return 1;
+  }
+  fwrite(header, 1, 12, stdout);
+  for(;;){
+    unsigned char chunk[8];
+    if(fread(chunk, 1, 8, stdin) != 8){
+      fprintf(stderr, "%s: no data chunk\n", argv[0]);
+      return 1;
+    }
+    fwrite(chunk, 1, 8, stdout);
+    if(!memcmp(chunk, "data", 4))
+      break;
+    const uint32_t size = read_le32(chunk+4);
+    if(!memcmp(chunk, "fmt ", 4) && size >= 16){
+      unsigned char fmt[16];
+      if(fread(fmt, 1, 16, stdin) != 16)
+        return 1;
+      if(fmt[0] != 1 || fmt[14] != 16){
+        fprintf(stderr, "%s: only 16bit integer samples are supported, use d2s -f s16\n", argv[0]);
+        return 1;
+      }
+      fwrite(fmt, 1, 16, stdout);
+      for(uint32_t i=16; i<size+(size&1); i++)
+        putchar(getchar());
+      continue;
+    }
+    for(uint32_t i=0; i<size+(size&1); i++)
+      putchar(getchar());
+  }
+  for(long i=0; i<delay; i++)
+    write_sample(0);
+  unsigned char p[2];
+  for(long i=0; fread(p, 1, 2, stdin) == 2; i++)
+    if(i < slip_at || i >= slip_at + slip)
+      write_sample(saturate((int16_t)(p[0] | p[1] << 8) * gain + noise * gaussian()));
+  return ferror(stdout) || fflush(stdout);
+}
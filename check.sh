@@ -0,0 +1,125 @@
+#!/bin/sh
+# Round trip check. Encodes a random payload with d2s, sends it over a clean channel and ones with noise, a different
+# gain and silence in front (see channel.c), and requires s2d to give back the payload byte for byte, with every
+# frequency detection engine, with and without batches (-b) and SIMD kernels (-S), from stdin and from the file.
+# Recordings that slipped a few samples, with error correction and resyncs, only need to come back right after the
+# resync that follows the slip. Long symbols with many carriers are checked with a larger payload, over the clean
+# channel only, where the noise of the others would hide how exact the frequency detection engines are.
+# Prints the failures, and exits non zero if there are any.
+
+BIN=${BIN:-build/release}
+size=3000
+
+usage(){
+  cat >&2 <<USAGE
+usage: $0 [-s bytes]
+  -s  payload size, defaults to $size bytes. The slipped round trips need a resync after the slip, at least 1500.
+Uses the programs in \$BIN, defaults to build/release.
+USAGE
+  exit 1
+}
+
+while getopts s: opt
+do
+  case $opt in
+    s) size=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+head -c "$size" /dev/urandom > "$work/payload"
+head -c "$((size * 20))" /dev/urandom > "$work/large"
+
+runs=0
+failures=0
+payload=$work/payload
+tail=
+clean=
+
+# Runs s2d with the given flags on the signal, and compares what it decoded with the payload, or its last $tail bytes
+decode(){
+  runs=$((runs + 1))
+  if [ "$source" = stdin ]
+    then "$BIN/s2d" "$@" < "$work/signal.wav" > "$work/decoded" 2> "$work/errors"
+    else "$BIN/s2d" "$@" "$work/signal.wav" > "$work/decoded" 2> "$work/errors"
+  fi
+  if [ "$tail" ]
+    then tail -c "$tail" "$payload" > "$work/expected"; tail -c "$tail" "$work/decoded" | cmp -s "$work/expected"
+    else cmp -s "$payload" "$work/decoded"
+  fi
+  if [ $? != 0 ]
+  then
+    failures=$((failures + 1))
+    echo "FAIL: d2s $encoding -f s16 | channel $channel | s2d $* ($source)"
+    sed 's/^/  /' "$work/errors"
+  fi
+}
+
+# Encodes the payload with the given d2s flags, and decodes it every way there is.
+# With resyncs (-r), the file is decoded in parallel too.
+round_trips(){
+  encoding="$*"
+  if ! "$BIN/d2s" "$@" -f s16 < "$payload" | cat > "$work/clean.wav"
+  then
+    failures=$((failures + 1))
+    echo "FAIL: d2s $encoding"
+    return
+  fi
+  if [ "$tail" ]
+  then
+    at=$(($(wc -c < "$work/clean.wav") / 2 * 3 / 10))
+    set -- "1 0 0 $at 20" "0.8 100 0 $at 13"
+  elif [ "$clean" ]
+  then
+    set -- "1 0 0"
+  else
+    set -- "1 0 0" "0.5 150 0" "0.8 100 37"
+  fi
+  for channel
+  do
+    "$BIN/channel" $channel < "$work/clean.wav" > "$work/signal.wav" || exit 1
+    for source in stdin file
+    do
+      for engine in dft goertzel fft
+      do
+        decode -e $engine
+        decode -e $engine -b
+        decode -e $engine -S
+        decode -e $engine -b -S
+      done
+    done
+    case " $encoding " in
+      *" -r "*) source=file; decode -j 3 ;;
+    esac
+  done
+}
+
+# Like round_trips, over channels that drop a whole symbol and two thirds of one, 30% into the signal
+slipped_round_trips(){
+  tail=$((size / 3))
+  round_trips "$@"
+  tail=
+}
+
+# Like round_trips, with a payload 20 times the size, over the clean channel only
+large_round_trips(){
+  payload=$work/large
+  clean=1
+  round_trips "$@"
+  payload=$work/payload
+  clean=
+}
+
+round_trips # The defaults
+round_trips -r 1000
+round_trips -a 2 -c 16
+round_trips -p 2 -c 64 -g 8
+round_trips -R 4 -k -r 2000
+slipped_round_trips -R 2 -r 1000
+slipped_round_trips -R 2 -k -r 1000
+large_round_trips -p 3 -c 128 -n 1024 # Long symbols, where the goertzel filters need their precision
+
+echo "check: $((runs - failures)) of $runs round trips decoded the payload"
+[ "$failures" = 0 ]
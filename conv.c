@@ -0,0 +1,191 @@
+#include <string.h>
+
+#include "conv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONV_SSE2
+#include <emmintrin.h>
+#endif
+
+// The encoder state is the last 6 data bits, the most recent one lowest. Together with the current bit,
+// that's the 7 bits the polynomials are applied to. Both polynomials use the current and the oldest bit,
+// so states j and j+32 have the same successors, 2j for a 0 bit and 2j+1 for a 1 bit, and the coded bits of the 4
+// transitions between them are those of j to 2j, or their complement. The Viterbi decoder handles them as one butterfly.
+
+enum {
+  CONV_POLYNOMIAL_A = 0171,
+  CONV_POLYNOMIAL_B = 0133,
+  CONV_STATE_COUNT = 64,
+  CONV_BUTTERFLY_COUNT = CONV_STATE_COUNT / 2,
+  CONV_STEP_MAX = (CONV_DATA_MAX + 1) * 8,
+  // Path metrics of states the encoder can't be in yet. Metrics stay within a few thousand of each other,
+  // the branch metrics of 6 steps, so this is low enough, but far from the limits of an int16_t.
+  CONV_METRIC_UNREACHABLE = -4096,
+};
+
+static inline unsigned parity(unsigned x){
+  x ^= x >> 4;
+  x ^= x >> 2;
+  x ^= x >> 1;
+  return x & 1;
+}
+
+static size_t gcd(size_t a, size_t b){
+  while(b){
+    const size_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+// Works out where each coded bit of a block of size bytes is sent, see conv.h. Coded bit p is in row p / columns,
+// the columns are sent one after another, every step-th, which steps through all of them as step has no factor in
+// common with their number. The last row may be short.
+static void interleave(size_t size, size_t symbol_size, uint16_t sent[CONV_BLOCK_SIZE * 8]){
+  const size_t bit_count = size * 8;
+  const size_t rows = symbol_size * 8 < bit_count ? symbol_size * 8 : bit_count;
+  const size_t columns = (bit_count + rows - 1) / rows;
+  size_t step = columns / 2 < CONV_SPREAD ? columns / 2 : CONV_SPREAD;
+  while(gcd(step, columns) != 1)
+    step++;
+  uint16_t column[CONV_BLOCK_SIZE * 8]; // In the order they are sent
+  for(size_t c=0; c<columns; c++)
+    column[c * step % columns] = c;
+  size_t t = 0;
+  for(size_t k=0; k<columns; k++){
+    for(size_t r=0; r<rows; r++){
+      const size_t p = r * columns + column[k];
+      if(p < bit_count)
+        sent[p] = t++;
+    }
+  }
+}
+
+void conv_encode(const unsigned char* data, size_t size, size_t symbol_size, unsigned char* block){
+  const size_t block_size = conv_block_size(size);
+  uint16_t sent[CONV_BLOCK_SIZE * 8];
+  interleave(block_size, symbol_size, sent);
+  memset(block, 0, block_size);
+  unsigned state = 0;
+  size_t p = 0; // Coded bits so far
+  for(size_t i=0; i<=size; i++){
+    const unsigned byte = i < size ? data[i] : 0;
+    for(int b=7; b>=0; b--){
+      const unsigned bits = state << 1 | (byte >> b & 1);
+      const unsigned a = sent[p++], c = sent[p++];
+      block[a/8] |= parity(bits & CONV_POLYNOMIAL_A) << (7 - a%8);
+      block[c/8] |= parity(bits & CONV_POLYNOMIAL_B) << (7 - c%8);
+      state = bits % CONV_STATE_COUNT;
+    }
+  }
+}
+
+// The path metric of a state is the correlation of the coded bits along the best path to it with the soft decisions.
+// The branch metric of a butterfly is that of the transition from j to 2j, its soft decisions negated where it has a
+// 0 bit: mask[i][j] is -1 for those, 0 otherwise. decisions[t] has bit n set if the best path to state n after step t
+// comes from the upper state of its butterfly. Metrics are kept relative to the one of state 0, so they don't overflow.
+
+static void viterbi_forward(size_t steps, int8_t soft[][2], int16_t mask[2][CONV_BUTTERFLY_COUNT], uint64_t decisions[]){
+  int16_t metric[CONV_STATE_COUNT];
+  for(int s=0; s<CONV_STATE_COUNT; s++)
+    metric[s] = s ? CONV_METRIC_UNREACHABLE : 0;
+  for(size_t t=0; t<steps; t++){
+    int16_t next[CONV_STATE_COUNT];
+    uint64_t decision = 0;
+    for(int j=0; j<CONV_BUTTERFLY_COUNT; j++){
+      const int16_t branch = ((soft[t][0] ^ mask[0][j]) - mask[0][j]) + ((soft[t][1] ^ mask[1][j]) - mask[1][j]);
+      const int16_t lower0 = metric[j] + branch, upper0 = metric[j+CONV_BUTTERFLY_COUNT] - branch;
+      const int16_t lower1 = metric[j] - branch, upper1 = metric[j+CONV_BUTTERFLY_COUNT] + branch;
+      next[2*j] = upper0 > lower0 ? upper0 : lower0;
+      next[2*j+1] = upper1 > lower1 ? upper1 : lower1;
+      decision |= (uint64_t)(upper0 > lower0) << 2*j | (uint64_t)(upper1 > lower1) << (2*j+1);
+    }
+    decisions[t] = decision;
+    for(int s=0; s<CONV_STATE_COUNT; s++)
+      metric[s] = next[s] - next[0];
+  }
+}
+
+#ifdef CONV_SSE2
+// 8 butterflies at a time. Interleaving the metrics for a 0 and a 1 bit puts the successors in order.
+__attribute__((target("sse2")))
+static void viterbi_forward_sse2(size_t steps, int8_t soft[][2], int16_t mask[2][CONV_BUTTERFLY_COUNT], uint64_t decisions[]){
+  enum { VECTORS = CONV_BUTTERFLY_COUNT / 8 };
+  __m128i metric[2*VECTORS];
+  __m128i mask0[VECTORS], mask1[VECTORS];
+  for(int k=0; k<VECTORS; k++){
+    metric[k] = metric[k+VECTORS] = _mm_set1_epi16(CONV_METRIC_UNREACHABLE);
+    mask0[k] = _mm_loadu_si128((const __m128i*)&mask[0][k*8]);
+    mask1[k] = _mm_loadu_si128((const __m128i*)&mask[1][k*8]);
+  }
+  metric[0] = _mm_insert_epi16(metric[0], 0, 0);
+  for(size_t t=0; t<steps; t++){
+    const __m128i soft0 = _mm_set1_epi16(soft[t][0]);
+    const __m128i soft1 = _mm_set1_epi16(soft[t][1]);
+    __m128i next[2*VECTORS];
+    uint64_t decision = 0;
+    for(int k=0; k<VECTORS; k++){
+      const __m128i branch = _mm_add_epi16(
+        _mm_sub_epi16(_mm_xor_si128(soft0, mask0[k]), mask0[k]),
+        _mm_sub_epi16(_mm_xor_si128(soft1, mask1[k]), mask1[k])
+      );
+      const __m128i lower0 = _mm_add_epi16(metric[k], branch), upper0 = _mm_sub_epi16(metric[k+VECTORS], branch);
+      const __m128i lower1 = _mm_sub_epi16(metric[k], branch), upper1 = _mm_add_epi16(metric[k+VECTORS], branch);
+      const __m128i next0 = _mm_max_epi16(lower0, upper0), next1 = _mm_max_epi16(lower1, upper1);
+      const __m128i decision0 = _mm_cmpgt_epi16(upper0, lower0), decision1 = _mm_cmpgt_epi16(upper1, lower1);
+      next[2*k] = _mm_unpacklo_epi16(next0, next1);
+      next[2*k+1] = _mm_unpackhi_epi16(next0, next1);
+      const __m128i bytes = _mm_packs_epi16(_mm_unpacklo_epi16(decision0, decision1), _mm_unpackhi_epi16(decision0, decision1));
+      decision |= (uint64_t)(uint16_t)_mm_movemask_epi8(bytes) << 16*k;
+    }
+    decisions[t] = decision;
+    const __m128i base = _mm_set1_epi16((int16_t)_mm_cvtsi128_si32(next[0]));
+    for(int k=0; k<2*VECTORS; k++)
+      metric[k] = _mm_sub_epi16(next[k], base);
+  }
+}
+#endif
+
+static void (*g_viterbi_forward)(size_t, int8_t[][2], int16_t[2][CONV_BUTTERFLY_COUNT], uint64_t[]) = viterbi_forward;
+
+void conv_select_kernels(bool allow_simd){
+  g_viterbi_forward = viterbi_forward;
+  if(!allow_simd)
+    return;
+#ifdef CONV_SSE2
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2"))
+    g_viterbi_forward = viterbi_forward_sse2;
+#endif
+}
+
+void conv_decode(const conv_soft* soft, size_t size, size_t symbol_size, unsigned char* data){
+  const size_t data_size = conv_block_data_size(size);
+  const size_t steps = (data_size + 1) * 8;
+  if(!data_size)
+    return;
+  int16_t mask[2][CONV_BUTTERFLY_COUNT];
+  for(int j=0; j<CONV_BUTTERFLY_COUNT; j++){
+    mask[0][j] = (int)parity(j << 1 & CONV_POLYNOMIAL_A) - 1;
+    mask[1][j] = (int)parity(j << 1 & CONV_POLYNOMIAL_B) - 1;
+  }
+  // The soft decisions of each step, in the order the bits were coded
+  uint16_t sent[CONV_BLOCK_SIZE * 8];
+  interleave(size, symbol_size, sent);
+  int8_t pair[CONV_STEP_MAX][2];
+  for(size_t p=0; p<2*steps; p++){
+    const unsigned t = sent[p];
+    pair[p/2][p%2] = soft[t/8*8 + 7 - t%8];
+  }
+  uint64_t decisions[CONV_STEP_MAX];
+  g_viterbi_forward(steps, pair, mask, decisions);
+  // Trace the best path back from state 0, where the last byte of 0 bits left the encoder
+  memset(data, 0, data_size);
+  unsigned state = 0;
+  for(size_t t=steps; t--; ){
+    if(t < data_size * 8)
+      data[t/8] |= (state & 1) << (7 - t%8);
+    state = state >> 1 | (unsigned)(decisions[t] >> state & 1) << 5;
+  }
+}
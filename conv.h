@@ -0,0 +1,48 @@
+#ifndef CONV_H
+#define CONV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Rate 1/2 convolutional code with constraint length 7, shared by d2s and s2d.
+// Each data bit, most significant first, is sent as 2 coded bits, from the generator polynomials 171 and 133 (octal)
+// over it and the 6 bits before it. The payload is coded in blocks, each of which starts from all 0 bits, and ends
+// with a byte of 0 bits, so that the decoder knows where the encoder ended up. Blocks are decoded by a Viterbi decoder
+// from soft decisions: how sure the demodulator is of each coded bit, rather than just the bit.
+// The coded bits of a block are interleaved, so that the errors of a badly received symbol, or of two with phase shift
+// keying, where each is the reference of the next, are scattered over the block: the code copes with those far better
+// than with a burst. They are laid out in rows as long as there are symbols in the block, so that each symbol is sent
+// one column, and the columns are sent CONV_SPREAD apart, as far as the block allows.
+
+enum {
+  CONV_DATA_MAX = 255, // Data bytes per block, a whole Reed-Solomon block. The last one of a stream holds less.
+  CONV_BLOCK_SIZE = 2 * (CONV_DATA_MAX + 1),
+  CONV_SOFT_UNIT = 4, // The soft decision of a log-likelihood ratio of 1
+  CONV_SPREAD = 7, // Symbols between neighbouring coded bits
+};
+
+// A soft decision is the log-likelihood ratio of a bit, the natural logarithm of how much likelier it is to be 1 than 0,
+// in units of 1/CONV_SOFT_UNIT, up to +-127. So it's positive for a 1 bit, negative for a 0 bit, and the larger the surer.
+// Bit i of coded byte j, with the value 1<<i, is soft[j*8+i].
+typedef int8_t conv_soft;
+
+// Chooses the fastest Viterbi kernel the CPU supports, they all give the same results
+void conv_select_kernels(bool allow_simd);
+
+// The size of a block holding size bytes of data
+static inline size_t conv_block_size(size_t size){
+  return 2 * (size + 1);
+}
+
+// The data a block of size bytes holds, 0 if no block has that size
+static inline size_t conv_block_data_size(size_t size){
+  return size % 2 || size < 4 ? 0 : size / 2 - 1;
+}
+
+// symbol_size is the payload of a data symbol, in bytes, which the interleaving is laid out for
+void conv_encode(const unsigned char* data, size_t size, size_t symbol_size, unsigned char* block);
+// Decodes a block of size bytes, given as the soft decisions of its bits, and stores its data
+void conv_decode(const conv_soft* soft, size_t size, size_t symbol_size, unsigned char* data);
+
+#endif
@@ -1,74 +1,922 @@
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "conv.h"
+#include "fft.h"
+#include "modem.h"
+#include "rs.h"
 
 #ifndef M_PI
 #define M_PI 3.141592653589793
 #endif
 
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+// Parameters of the transmission, sent to the decoder in the preamble
+static struct modem_profile g_profile;
+
+//////////////////
+// Output stage //
+//////////////////
+
+// Samples are packed into one large block and written out with a single syscall.
+// In vectored mode, the output instead references the cached symbol blocks and hands them to writev,
+// which avoids copying them at all. Referenced memory must stay unchanged until the next output_flush.
+
+enum { OUTPUT_BUFFER_SIZE = 1<<16 };
+
+static bool g_vectored;
+static unsigned char g_output[OUTPUT_BUFFER_SIZE];
+static size_t g_output_size;
+static struct iovec g_iov[IOV_MAX];
+static int g_iov_count;
+static uint64_t g_output_total; // Bytes written to stdout so far
+
+static void output_writev(struct iovec* iov, int count){
+  while(count){
+    ssize_t ret = writev(STDOUT_FILENO, iov, count);
+    if(ret < 0){
+      if(errno == EINTR)
+        continue;
+      perror("writev");
+      exit(1);
+    }
+    g_output_total += ret;
+    for(; count && (size_t)ret >= iov->iov_len; iov++, count--)
+      ret -= iov->iov_len;
+    if(count){
+      iov->iov_base = (char*)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+}
+
+void output_flush(){
+  if(g_vectored){
+    output_writev(g_iov, g_iov_count);
+    g_iov_count = 0;
+    g_output_size = 0; // Used by output_write_copy
+  }else{
+    output_writev(&(struct iovec){ .iov_base = g_output, .iov_len = g_output_size }, 1);
+    g_output_size = 0;
+  }
+}
+
+// Data is referenced in vectored mode, so it must stay valid & unchanged until the next output_flush.
+void output_write(const void* data, size_t size){
+  if(g_vectored){
+    if(g_iov_count >= IOV_MAX)
+      output_flush();
+    g_iov[g_iov_count++] = (struct iovec){ .iov_base = (void*)data, .iov_len = size };
+    return;
+  }
+  if(g_output_size + size > sizeof(g_output))
+    output_flush();
+  if(size > sizeof(g_output)){
+    output_writev(&(struct iovec){ .iov_base = (void*)data, .iov_len = size }, 1);
+    return;
+  }
+  memcpy(g_output + g_output_size, data, size);
+  g_output_size += size;
+}
+
+// Like output_write, but the data only has to stay valid during the call. It's copied to the output buffer in vectored mode too.
+void output_write_copy(const void* data, size_t size){
+  if(!g_vectored){
+    output_write(data, size);
+    return;
+  }
+  if(g_output_size + size > sizeof(g_output) || g_iov_count >= IOV_MAX)
+    output_flush();
+  memcpy(g_output + g_output_size, data, size);
+  output_write(g_output + g_output_size, size);
+  g_output_size += size;
+}
+
 enum {
-  BIT_COUNT = 9,
-  SAMPLE_COUNT_MIN = BIT_COUNT*2+1, // We need at least this many samples for our data
-  SAMPLE_COUNT = SAMPLE_COUNT_MIN + 1, // We add a few extra samples, this gives some tolerance
+  WAV_FORMAT_PCM = 1,
+  WAV_FORMAT_FLOAT = 3,
 };
 
+struct sample_format {
+  const char* name;
+  uint16_t tag; // WAV format tag
+  uint16_t size; // Bytes per sample
+};
+
+static const struct sample_format g_sample_formats[] = {
+  { "s16", WAV_FORMAT_PCM,   2 },
+  { "s24", WAV_FORMAT_PCM,   3 },
+  { "s32", WAV_FORMAT_PCM,   4 },
+  { "f32", WAV_FORMAT_FLOAT, 4 },
+};
+
+enum { SAMPLE_SIZE_MAX = 4 };
+
+static const struct sample_format* g_sample_format = &g_sample_formats[2];
+
+static const struct sample_format* find_sample_format(const char* name){
+  for(size_t i=0; i<sizeof(g_sample_formats)/sizeof(*g_sample_formats); i++)
+    if(!strcmp(g_sample_formats[i].name, name))
+      return &g_sample_formats[i];
+  return NULL;
+}
+
+static void put_le16(unsigned char p[2], uint16_t x){
+  p[0] = x;
+  p[1] = x >> 8;
+}
+
+static void put_le32(unsigned char p[4], uint32_t x){
+  put_le16(p, x);
+  put_le16(p+2, x >> 16);
+}
+
+static void put_le64(unsigned char p[8], uint64_t x){
+  put_le32(p, x);
+  put_le32(p+4, x >> 32);
+}
+
+enum {
+  DS64_SIZE = 28, // RIFF size, data size, sample count and an empty table
+  WAV_HEADER_SIZE_MAX = 12 + 8+DS64_SIZE + 8+16 + 8,
+};
+
+// Where the WAV file starts in stdout if the output is seekable, -1 otherwise
+static off_t g_wav_offset = -1;
+static size_t g_wav_header_size;
+
+// Only regular files can be patched up afterwards. With O_APPEND, pwrite would append instead.
+static void detect_seekable_output(){
+  struct stat st;
+  const int flags = fcntl(STDOUT_FILENO, F_GETFL);
+  if(fstat(STDOUT_FILENO, &st) || !S_ISREG(st.st_mode) || flags == -1 || (flags & O_APPEND))
+    return;
+  g_wav_offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+}
+
+// The length isn't known up front. Streamed output keeps the large placeholder sizes.
+// Seekable output gets the real ones in finish_wav, and reserves a JUNK chunk,
+// which becomes the ds64 chunk of an RF64 file if the sizes don't fit into 32bit.
 static void write_wav_header(){
-  static const unsigned char header[] =
-    "RIFF\x24\0\0\x80WAVE"
-    "fmt \x10\0\0\0\1\0\1\0\x44\xAC\0\0\0\xEE\2\0\4\0\x20\0"
-    "data\0\0\0\x80";
-  fwrite(header, 1, sizeof(header)-1, stdout);
+  static unsigned char header[WAV_HEADER_SIZE_MAX]; // Referenced by the output stage until the next flush
+  unsigned char* p = header;
+  memcpy(p, "RIFF\x24\0\0\x80WAVE", 12);
+  p += 12;
+  if(g_wav_offset != -1){
+    memcpy(p, "JUNK", 4);
+    put_le32(p+4, DS64_SIZE);
+    p += 8 + DS64_SIZE;
+  }
+  memcpy(p, "fmt \x10\0\0\0", 8);
+  put_le16(p+8, g_sample_format->tag);
+  put_le16(p+10, 1); // Channels
+  put_le32(p+12, g_profile.sample_rate);
+  put_le32(p+16, g_profile.sample_rate * g_sample_format->size);
+  put_le16(p+20, g_sample_format->size);
+  put_le16(p+22, g_sample_format->size * 8);
+  p += 24;
+  memcpy(p, "data\0\0\0\x80", 8);
+  p += 8;
+  g_wav_header_size = p - header;
+  output_write(header, g_wav_header_size);
+}
+
+static void patch_output(off_t offset, const void* data, size_t size){
+  if(pwrite(STDOUT_FILENO, data, size, g_wav_offset + offset) != (ssize_t)size){
+    perror("pwrite");
+    exit(1);
+  }
 }
 
-void write_sample(double x){
+// Fills in the real sizes, once all the data has been written
+static void finish_wav(){
+  if(g_wav_offset == -1)
+    return;
+  const uint64_t data_size = g_output_total - g_wav_header_size;
+  if(data_size & 1){ // Chunks are padded to an even size
+    output_write("", 1);
+    output_flush();
+  }
+  const uint64_t riff_size = g_output_total - 8;
+  unsigned char size[4];
+  if(riff_size <= UINT32_MAX){
+    put_le32(size, riff_size);
+    patch_output(4, size, 4);
+    put_le32(size, data_size);
+    patch_output(g_wav_header_size-4, size, 4);
+    return;
+  }
+  // RF64: The 32bit sizes are set to -1, the real ones are in the ds64 chunk
+  unsigned char header[12 + 8+DS64_SIZE] = "RF64\xFF\xFF\xFF\xFFWAVEds64";
+  put_le32(header+16, DS64_SIZE);
+  put_le64(header+20, riff_size);
+  put_le64(header+28, data_size);
+  put_le64(header+36, data_size / g_sample_format->size); // Sample count
+  patch_output(0, header, sizeof(header));
+  patch_output(g_wav_header_size-4, "\xFF\xFF\xFF\xFF", 4);
+}
+
+static void encode_sample(double x, unsigned char* out){
   if(x >  1) x =  1;
   if(x < -1) x = -1;
-  uint32_t sample = x * 0x7FFFFFFF;
-  putchar(sample);
-  putchar(sample >>  8);
-  putchar(sample >> 16);
-  putchar(sample >> 24);
+  uint32_t sample;
+  if(g_sample_format->tag == WAV_FORMAT_FLOAT){
+    const float f = x;
+    memcpy(&sample, &f, sizeof(sample));
+  }else{
+    const int bits = g_sample_format->size * 8;
+    sample = (int32_t)(x * (int32_t)(((uint32_t)1 << (bits-1)) - 1)); // Converting a negative value straight to unsigned is undefined
+  }
+  for(int i=0; i<g_sample_format->size; i++)
+    out[i] = sample >> i*8;
+}
+
+#define PREAMBLE_LEVEL 0x200u // Symbol is sent with the amplitude of the preamble instead of the one for data
+#define TRAINING_SIGNAL 0x400u // All data carriers at the amplitude level or phase in the low bits, and the sync signal
+#define GUARD_INTERVAL 0x800u // Symbol is preceded by its cyclic prefix, like all symbols following the start signal
+
+static const double g_data_amplitude = 0.16;
+// With phase shift keying, all carriers are always on. The sync signal, which the phases are measured against,
+// is twice as loud as the data carriers. With 8 of them, they can't clip even when they all line up.
+static const double g_phase_amplitude = 0.1;
+static const double g_phase_sync_amplitude = 0.2;
+
+// Symbols are passed around as their bits ORed with PREAMBLE_LEVEL if applicable
+static double symbol_amplitude(unsigned symbol){
+  if(symbol & PREAMBLE_LEVEL)
+    return 1; // Only one sine wave
+  // We have up to 9 sign waves adding up.
+  // If there is any clipping, the signal gets worse. Same if it's less loud.
+  return g_data_amplitude;
+}
+
+// The amplitude of the data carriers of a data symbol. The more there are, the less likely it is for all of them
+// to line up, so they get quieter with the square root of their number, which keeps their total power the same.
+static double carrier_amplitude(){
+  const double amplitude = g_profile.modulation == MODULATION_PHASE ? g_phase_amplitude : g_data_amplitude;
+  return amplitude * sqrt((BIT_COUNT-1.) / (g_profile.carrier_count-1));
+}
+
+// Waveform of each carrier over one symbol. The arguments to sin only ever take carrier_count*sample_count distinct values.
+static double g_wave[CARRIER_COUNT_MAX][SAMPLE_COUNT_MAX];
+// The same, a quarter cycle ahead, for other phases
+static double g_wave_cos[CARRIER_COUNT_MAX][SAMPLE_COUNT_MAX];
+
+static void init_wave_table(){
+  for(int c=0; c<g_profile.carrier_count; c++){
+    for(int t=0; t<g_profile.sample_count; t++){
+      g_wave[c][t] = sin(2.*M_PI*(c+1)*t/g_profile.sample_count);
+      g_wave_cos[c][t] = cos(2.*M_PI*(c+1)*t/g_profile.sample_count);
+    }
+  }
 }
 
-static double g_amplitude;
+// A data carrier at a level is its waveform times the sine factor, plus the one a quarter cycle ahead times the cosine factor.
+// If all carriers started at the same phase, they'd add up to a high peak at the start of every symbol with many of
+// them on, which would clip. So each has its own phase offset, spread out quadratically (Schroeder phases).
+// The decoder doesn't care, amplitude levels are told apart by power only, and phase shifts are relative.
+static double g_level_sin[CARRIER_COUNT_MAX][1<<BITS_PER_CARRIER_MAX];
+static double g_level_cos[CARRIER_COUNT_MAX][1<<BITS_PER_CARRIER_MAX];
 
-void print_byte(unsigned ch){
-  for(int t=0; t<SAMPLE_COUNT; t++){
+static void init_level_table(){
+  const unsigned level_count = 1u << g_profile.bits_per_carrier;
+  const int data_carriers = g_profile.carrier_count - 1;
+  for(int c=1; c<=data_carriers; c++){
+    const double offset = M_PI * c * c / data_carriers;
+    for(unsigned l=0; l<level_count; l++){
+      double amplitude = 1;
+      double phase = offset;
+      if(g_profile.modulation == MODULATION_PHASE){
+        phase += 2.*M_PI*l/level_count;
+      }else{
+        amplitude = l / (level_count - 1.);
+      }
+      g_level_sin[c][l] = amplitude * cos(phase);
+      g_level_cos[c][l] = amplitude * sin(phase);
+    }
+  }
+}
+
+// Every symbol is one of 2^BIT_COUNT patterns, at one of 2 amplitudes, so the whole encoded PCM block of each is cached.
+static unsigned char g_symbol_pcm[PREAMBLE_LEVEL<<1][SAMPLE_COUNT_MAX*SAMPLE_SIZE_MAX];
+static unsigned char g_training_pcm[1<<BITS_PER_CARRIER_MAX][SAMPLE_COUNT_MAX*SAMPLE_SIZE_MAX];
+
+static void synthesize_symbol(unsigned symbol, unsigned char pcm[SAMPLE_COUNT_MAX*SAMPLE_SIZE_MAX]){
+  const double amplitude = symbol_amplitude(symbol);
+  for(int t=0; t<g_profile.sample_count; t++){
     double sample = 0;
     for(int b=0; b<BIT_COUNT; b++){ // bits = frequencies to encode
-      if(!(ch & (1<<b)))
+      if(!(symbol & (1<<b)))
         continue;
-      sample += sin(2.*M_PI*(BIT_COUNT-b)*t/SAMPLE_COUNT); // Note: Highest byte encoded using lowest frequency.
+      sample += g_wave[BIT_COUNT-1-b][t]; // Note: Highest bit encoded using lowest frequency.
     }
-    sample *= g_amplitude;
-    write_sample(sample);
+    sample *= amplitude;
+    encode_sample(sample, pcm + t*g_sample_format->size);
   }
 }
 
-#define SYNC_SIGNAL 0x100u
+// With more carriers, adding up their waveforms takes time proportional to samples times carriers. Symbols are then
+// synthesized from their spectrum by an inverse FFT instead, which only takes time proportional to samples * log(samples).
+// For the usual 8 data carriers, both take about as long. NULL if the carriers are added up one by one.
+static struct fft_plan* g_fft_plan;
 
-int main(){
-  write_wav_header();
-  g_amplitude = 1; // Only one sine wave
+static void init_fft_plan(){
+  if(g_profile.carrier_count > BIT_COUNT)
+    g_fft_plan = fft_plan_create(g_profile.sample_count); // Without one, it just takes longer
+}
+
+// Multiple amplitude levels or phases, or more carriers: The data carriers have the given level, the sync signal is on.
+// There are too many combinations to cache them, so these are synthesized as needed.
+static void synthesize_levels(const unsigned level[CARRIER_COUNT_MAX-1], unsigned char pcm[SAMPLE_COUNT_MAX*SAMPLE_SIZE_MAX]){
+  const bool phase = g_profile.modulation == MODULATION_PHASE;
+  const double sync_amplitude = phase ? g_phase_sync_amplitude : g_data_amplitude;
+  const double amplitude = carrier_amplitude();
+  const int data_carriers = g_profile.carrier_count - 1;
+  double level_sin[CARRIER_COUNT_MAX];
+  double level_cos[CARRIER_COUNT_MAX];
+  for(int b=0; b<data_carriers; b++){
+    const int c = data_carriers - b;
+    level_sin[c] = g_level_sin[c][level[b]];
+    level_cos[c] = g_level_cos[c][level[b]];
+  }
+  if(g_fft_plan){
+    // A carrier with c+1 cycles per symbol is bin c+1. Its sine and cosine are split evenly between that bin and its mirror image.
+    struct fft_complex spectrum[SAMPLE_COUNT_MAX/2+1];
+    memset(spectrum, 0, sizeof(*spectrum) * (g_profile.sample_count/2+1));
+    spectrum[1].im = -sync_amplitude / 2;
+    for(int c=1; c<=data_carriers; c++)
+      spectrum[c+1] = (struct fft_complex){amplitude * level_cos[c] / 2, -amplitude * level_sin[c] / 2};
+    double signal[SAMPLE_COUNT_MAX];
+    fft_inverse(g_fft_plan, spectrum, signal);
+    for(int t=0; t<g_profile.sample_count; t++)
+      encode_sample(signal[t], pcm + t*g_sample_format->size);
+    return;
+  }
+  for(int t=0; t<g_profile.sample_count; t++){
+    double sample = 0;
+    for(int c=data_carriers; c>0; c--)
+      sample += level_sin[c] * g_wave[c][t] + level_cos[c] * g_wave_cos[c][t];
+    encode_sample(sync_amplitude * g_wave[0][t] + amplitude * sample, pcm + t*g_sample_format->size);
+  }
+}
+
+// Whether data symbols are synthesized from levels, rather than taken from the cache as on / off patterns
+static bool multilevel(){
+  return g_profile.modulation == MODULATION_PHASE || g_profile.bits_per_carrier > 1 || g_profile.carrier_count > BIT_COUNT;
+}
+
+// Whether the decoder is taught the amplitude levels, as they aren't simply on or off at the usual amplitude
+static bool trained_levels(){
+  return g_profile.modulation == MODULATION_AMPLITUDE && multilevel();
+}
+
+// Bytes of PCM data per symbol
+static size_t symbol_size(){
+  return g_profile.sample_count * g_sample_format->size;
+}
+
+// Bytes of PCM data of the cyclic prefix of symbols after the start signal
+static size_t guard_size(){
+  return g_profile.guard_count * g_sample_format->size;
+}
+
+// Payload bytes per data symbol
+static size_t symbol_bytes(){
+  return modem_symbol_bytes(&g_profile);
+}
+
+static void init_symbol_cache(){
+  for(unsigned symbol=0; symbol<PREAMBLE_LEVEL<<1; symbol++)
+    synthesize_symbol(symbol, g_symbol_pcm[symbol]);
+  if(multilevel()){
+    init_level_table();
+    for(unsigned l=0; l<1u<<g_profile.bits_per_carrier; l++){
+      unsigned level[CARRIER_COUNT_MAX-1];
+      for(int b=0; b<g_profile.carrier_count-1; b++)
+        level[b] = l;
+      synthesize_levels(level, g_training_pcm[l]);
+    }
+  }
+}
+
+// Symbols are appended to the buffer at pcm, or written to the output if it is NULL. Returns where the next symbol goes.
+static unsigned char* append_symbol(unsigned char* pcm, unsigned symbol){
+  const unsigned guard = symbol & GUARD_INTERVAL;
+  symbol &= ~GUARD_INTERVAL;
+  const unsigned char* cached = symbol & TRAINING_SIGNAL ? g_training_pcm[symbol & ~TRAINING_SIGNAL] : g_symbol_pcm[symbol];
+  const unsigned char* prefix = cached + symbol_size() - guard_size();
+  if(!pcm){
+    if(guard)
+      output_write(prefix, guard_size());
+    output_write(cached, symbol_size());
+    return pcm;
+  }
+  if(guard){
+    memcpy(pcm, prefix, guard_size());
+    pcm += guard_size();
+  }
+  memcpy(pcm, cached, symbol_size());
+  return pcm + symbol_size();
+}
+
+// With phase shift keying, the bits of a symbol say by how much each carrier's phase advances from the last symbol.
+// A preamble resets all of them to 0, and is followed by a reference symbol with that phase.
+struct modulator {
+  unsigned phase[CARRIER_COUNT_MAX-1];
+};
+
+// Every data carrier holds one bit of a byte of each group, as a level, or as a phase shift. See modem_symbol_bytes.
+static void symbol_levels(struct modulator*const modulator, const unsigned char* data, size_t size, unsigned level[CARRIER_COUNT_MAX-1]){
+  const unsigned level_mask = (1u << g_profile.bits_per_carrier) - 1;
+  const int groups = (g_profile.carrier_count - 1) / 8;
+  for(int b=0; b<g_profile.carrier_count-1; b++){
+    unsigned bits = 0;
+    for(size_t i=b/8; i<size; i+=groups)
+      bits |= (data[i] >> b%8 & 1) << i/groups;
+    level[b] = modem_bits_to_level(bits);
+    if(g_profile.modulation == MODULATION_PHASE)
+      level[b] = modulator->phase[b] = (modulator->phase[b] + level[b]) & level_mask;
+  }
+}
+
+// Appends one data symbol holding up to symbol_bytes() bytes. A shorter last one is announced by an END_SIGNAL.
+static unsigned char* append_data_symbol(unsigned char* pcm, struct modulator*const modulator, const unsigned char* data, size_t size){
+  if(!multilevel())
+    return append_symbol(pcm, data[0] | SYNC_SIGNAL | GUARD_INTERVAL);
+  if(size < symbol_bytes())
+    pcm = append_symbol(pcm, END_SIGNAL | size | GUARD_INTERVAL);
+  unsigned level[CARRIER_COUNT_MAX-1];
+  symbol_levels(modulator, data, size, level);
+  if(!pcm){
+    unsigned char buffer[SAMPLE_COUNT_MAX*SAMPLE_SIZE_MAX];
+    synthesize_levels(level, buffer);
+    output_write_copy(buffer + symbol_size() - guard_size(), guard_size());
+    output_write_copy(buffer, symbol_size());
+    return pcm;
+  }
+  synthesize_levels(level, pcm + guard_size());
+  memcpy(pcm, pcm + symbol_size(), guard_size());
+  return pcm + guard_size() + symbol_size();
+}
+
+enum {
+  CALIBRATION_LENGTH = 8,
+  PREAMBLE_LENGTH_MAX = 2 + CALIBRATION_LENGTH + 1 + MODEM_PROFILE_RECORD_MAX + (1<<BITS_PER_CARRIER_MAX) + 1 + 1,
+};
+
+static uint16_t g_preamble[PREAMBLE_LENGTH_MAX];
+static int g_preamble_length;
+
+static void init_preamble(){
+  uint16_t* p = g_preamble;
   // No data, baseline
-  print_byte(0);
-  print_byte(0);
+  *p++ = 0;
+  *p++ = 0;
   // For calibration: timing, phase, amplitude and polarity are determined here
-  print_byte(SYNC_SIGNAL);
-  print_byte(SYNC_SIGNAL);
-  print_byte(SYNC_SIGNAL);
-  print_byte(SYNC_SIGNAL);
-  print_byte(SYNC_SIGNAL);
-  print_byte(SYNC_SIGNAL);
-  print_byte(SYNC_SIGNAL);
-  print_byte(SYNC_SIGNAL);
-  // We have up to 9 sign waves adding up.
-  // If there is any clipping, the signal gets worse. Same if it's less loud.
-  g_amplitude = 0.16;
-  print_byte('>' | SYNC_SIGNAL); // Signify start of data
-  for(int ch; (ch=getchar())!=EOF; )
-    print_byte(ch | SYNC_SIGNAL);
-  print_byte(0);
-  print_byte(0);
+  for(int i=0; i<CALIBRATION_LENGTH; i++)
+    *p++ = SYNC_SIGNAL | PREAMBLE_LEVEL;
+  *p++ = PROFILE_SIGNAL | SYNC_SIGNAL;
+  unsigned char record[MODEM_PROFILE_RECORD_MAX];
+  const size_t record_size = modem_profile_encode(&g_profile, record);
+  for(size_t i=0; i<record_size; i++)
+    *p++ = record[i] | SYNC_SIGNAL;
+  // Each amplitude level once, from the lowest to the highest, so the decoder can learn them
+  if(trained_levels())
+    for(unsigned l=0; l<1u<<g_profile.bits_per_carrier; l++)
+      *p++ = TRAINING_SIGNAL | l;
+  *p++ = START_SIGNAL | SYNC_SIGNAL;
+  // The phase the first data symbol is relative to
+  if(g_profile.modulation == MODULATION_PHASE)
+    *p++ = TRAINING_SIGNAL | 0 | GUARD_INTERVAL;
+  g_preamble_length = p - g_preamble;
+}
+
+static unsigned char* append_preamble(unsigned char* pcm, struct modulator*const modulator){
+  for(int i=0; i<g_preamble_length; i++)
+    pcm = append_symbol(pcm, g_preamble[i]);
+  *modulator = (struct modulator){0};
+  return pcm;
+}
+
+// Payload bytes after which the transmission is restarted with a new preamble, 0 for never.
+// This allows the decoder to recover from lost synchronisation, and to split a recording at these points.
+static size_t g_resync_interval;
+
+// Whether a resync goes in front of the data symbol starting at offset
+static bool resync_due(size_t offset){
+  return g_resync_interval && offset && (offset + symbol_bytes() - 1) / g_resync_interval != (offset - 1) / g_resync_interval;
+}
+
+// With forward error correction, the input is coded into frames of Reed-Solomon blocks, see rs.h,
+// and with convolutional coding, that is coded again in blocks, see conv.h. Those make up the payload.
+static unsigned char g_fec_frame[RS_DEPTH_MAX * RS_BLOCK_SIZE];
+static size_t g_fec_frame_size;
+static size_t g_fec_frame_offset; // Bytes of the frame already read
+static unsigned char g_conv_block[CONV_BLOCK_SIZE];
+static size_t g_conv_block_size;
+static size_t g_conv_block_offset;
+
+// Reads up to size bytes of Reed-Solomon frames from stdin, like fread, it only returns less at the end
+static size_t read_fec(unsigned char* buffer, size_t size){
+  if(!g_profile.fec_depth)
+    return fread(buffer, 1, size, stdin);
+  size_t n = 0;
+  while(n < size){
+    if(g_fec_frame_offset == g_fec_frame_size){
+      unsigned char data[RS_DEPTH_MAX * RS_DATA_MAX];
+      const size_t data_size = fread(data, 1, g_profile.fec_depth * RS_DATA_MAX, stdin);
+      if(!data_size)
+        break;
+      g_fec_frame_size = rs_frame_size(g_profile.fec_depth, data_size);
+      g_fec_frame_offset = 0;
+      rs_frame_encode(g_profile.fec_depth, data, data_size, g_fec_frame);
+    }
+    const size_t count = size - n < g_fec_frame_size - g_fec_frame_offset ? size - n : g_fec_frame_size - g_fec_frame_offset;
+    memcpy(buffer + n, g_fec_frame + g_fec_frame_offset, count);
+    g_fec_frame_offset += count;
+    n += count;
+  }
+  return n;
+}
+
+// Reads up to size bytes of payload, it only returns less at the end
+static size_t read_payload(unsigned char* buffer, size_t size){
+  if(!g_profile.convolutional)
+    return read_fec(buffer, size);
+  size_t n = 0;
+  while(n < size){
+    if(g_conv_block_offset == g_conv_block_size){
+      unsigned char data[CONV_DATA_MAX];
+      const size_t data_size = read_fec(data, CONV_DATA_MAX);
+      if(!data_size)
+        break;
+      g_conv_block_size = conv_block_size(data_size);
+      g_conv_block_offset = 0;
+      conv_encode(data, data_size, symbol_bytes(), g_conv_block);
+    }
+    const size_t count = size - n < g_conv_block_size - g_conv_block_offset ? size - n : g_conv_block_size - g_conv_block_offset;
+    memcpy(buffer + n, g_conv_block + g_conv_block_offset, count);
+    g_conv_block_offset += count;
+    n += count;
+  }
+  return n;
+}
+
+// All but the last call must pass a whole number of data symbols
+static unsigned char* append_payload(unsigned char* pcm, struct modulator*const modulator, const unsigned char* data, size_t size, size_t offset){
+  for(size_t i=0; i<size; i+=symbol_bytes()){
+    if(resync_due(offset+i)){
+      pcm = append_symbol(pcm, RESYNC_SIGNAL | GUARD_INTERVAL);
+      pcm = append_preamble(pcm, modulator);
+    }
+    pcm = append_data_symbol(pcm, modulator, data+i, size-i < symbol_bytes() ? size-i : symbol_bytes());
+  }
+  return pcm;
+}
+
+// Brings the modulator to where it is after append_payload, without synthesizing anything
+static void skip_payload(struct modulator*const modulator, const unsigned char* data, size_t size, size_t offset){
+  if(g_profile.modulation != MODULATION_PHASE)
+    return;
+  for(size_t i=0; i<size; i+=symbol_bytes()){
+    if(resync_due(offset+i))
+      *modulator = (struct modulator){0};
+    unsigned level[CARRIER_COUNT_MAX-1];
+    symbol_levels(modulator, data+i, size-i < symbol_bytes() ? size-i : symbol_bytes(), level);
+  }
+}
+
+///////////////////////
+// Parallel encoding //
+///////////////////////
+
+// The payload is split into chunks, which are encoded by a pool of workers. The chunks live in a ring of slots,
+// and are written out in order once they are encoded, so the ring doubles as reorder buffer.
+// Only the payload is encoded in parallel, the amplitude, and with it the cached symbols, don't change during it.
+// The phases a chunk starts with depend on all data before it, the reader works them out as it fills the chunks.
+
+enum { CHUNK_SIZE = 1<<14 };
+
+struct chunk {
+  bool encoded;
+  size_t offset; // Of the first byte in the payload
+  size_t size;
+  struct modulator modulator; // At the start of the chunk
+  unsigned char input[CHUNK_SIZE];
+  size_t pcm_size;
+  unsigned char* pcm;
+};
+
+struct encoder_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t filled; // A chunk was filled, or the workers should stop
+  pthread_cond_t encoded; // A chunk was encoded
+  bool stop;
+  size_t next_fill; // Sequence number of the next chunk to be read from the input
+  size_t next_encode; // Sequence number of the next chunk to be encoded
+  size_t slot_count;
+  struct chunk* slots;
+};
+
+// Upper bound of the symbols in an encoded chunk
+static size_t chunk_symbol_count(){
+  size_t count = (CHUNK_SIZE + symbol_bytes() - 1) / symbol_bytes() + 1; // Possibly an END_SIGNAL
+  if(g_resync_interval)
+    count += (CHUNK_SIZE / g_resync_interval + 1) * (1 + g_preamble_length);
+  return count;
+}
+
+static void encode_chunk(struct chunk*const chunk){
+  chunk->pcm_size = append_payload(chunk->pcm, &chunk->modulator, chunk->input, chunk->size, chunk->offset) - chunk->pcm;
+}
+
+static void* encoder_worker(void* arg){
+  struct encoder_pool*const pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  while(true){
+    while(!pool->stop && pool->next_encode == pool->next_fill)
+      pthread_cond_wait(&pool->filled, &pool->lock);
+    if(pool->next_encode == pool->next_fill)
+      break;
+    struct chunk*const chunk = &pool->slots[pool->next_encode++ % pool->slot_count];
+    pthread_mutex_unlock(&pool->lock);
+    encode_chunk(chunk);
+    pthread_mutex_lock(&pool->lock);
+    chunk->encoded = true;
+    pthread_cond_broadcast(&pool->encoded);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+static void encode_parallel(struct modulator* modulator, int thread_count){
+  struct encoder_pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+    .encoded = PTHREAD_COND_INITIALIZER,
+    .slot_count = thread_count * 2,
+  };
+  pool.slots = calloc(pool.slot_count, sizeof(*pool.slots));
+  if(!pool.slots){
+    perror("calloc");
+    exit(1);
+  }
+  for(size_t i=0; i<pool.slot_count; i++){
+    pool.slots[i].pcm = malloc(chunk_symbol_count() * (guard_size() + symbol_size()));
+    if(!pool.slots[i].pcm){
+      perror("malloc");
+      exit(1);
+    }
+  }
+  pthread_t threads[thread_count];
+  for(int i=0; i<thread_count; i++){
+    int ret = pthread_create(&threads[i], 0, encoder_worker, &pool);
+    if(ret){
+      fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+      exit(1);
+    }
+  }
+  bool eof = false;
+  pthread_mutex_lock(&pool.lock);
+  for(size_t next_write=0; ; next_write++){
+    // Keep all free slots filled, so the workers always have something to do
+    while(!eof && pool.next_fill - next_write < pool.slot_count){
+      struct chunk*const chunk = &pool.slots[pool.next_fill % pool.slot_count];
+      pthread_mutex_unlock(&pool.lock);
+      // Chunks hold whole data symbols. read_payload only returns less than asked for at the end.
+      const size_t chunk_size = CHUNK_SIZE - CHUNK_SIZE % symbol_bytes();
+      chunk->offset = pool.next_fill * chunk_size;
+      chunk->size = read_payload(chunk->input, chunk_size);
+      chunk->encoded = false;
+      pthread_mutex_lock(&pool.lock);
+      if(!chunk->size){
+        eof = true;
+        break;
+      }
+      chunk->modulator = *modulator;
+      skip_payload(modulator, chunk->input, chunk->size, chunk->offset);
+      pool.next_fill++;
+      pthread_cond_signal(&pool.filled);
+    }
+    if(next_write == pool.next_fill)
+      break;
+    struct chunk*const chunk = &pool.slots[next_write % pool.slot_count];
+    while(!chunk->encoded)
+      pthread_cond_wait(&pool.encoded, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    output_write(chunk->pcm, chunk->pcm_size);
+    output_flush(); // The slot is about to be reused
+    pthread_mutex_lock(&pool.lock);
+  }
+  pool.stop = true;
+  pthread_cond_broadcast(&pool.filled);
+  pthread_mutex_unlock(&pool.lock);
+  for(int i=0; i<thread_count; i++)
+    pthread_join(threads[i], 0);
+  for(size_t i=0; i<pool.slot_count; i++)
+    free(pool.slots[i].pcm);
+  free(pool.slots);
+}
+
+enum { INPUT_BUFFER_SIZE = 1<<16 };
+enum { THREAD_COUNT_MAX = 256 };
+
+int main(int argc, char* argv[]){
+  g_profile = modem_profile_default;
+  int thread_count = 1;
+  bool sample_count_given = false;
+  bool modulation_given = false;
+  for(int opt; (opt=getopt(argc, argv, "a:c:f:g:j:kn:p:r:R:s:v")) != -1; ){
+    switch(opt){
+      case 'a': {
+        char* end;
+        long n = strtol(optarg, &end, 10);
+        if(*end || n < 1 || n > BITS_PER_CARRIER_MAX){
+          fprintf(stderr, "%s: the bits per carrier must be between 1 and %d\n", argv[0], BITS_PER_CARRIER_MAX);
+          return 1;
+        }
+        if(modulation_given && g_profile.modulation != MODULATION_AMPLITUDE){
+          fprintf(stderr, "%s: -a and -p are exclusive\n", argv[0]);
+          return 1;
+        }
+        g_profile.bits_per_carrier = n;
+        g_profile.modulation = MODULATION_AMPLITUDE;
+        modulation_given = true;
+      } break;
+      case 'c': {
+        char* end;
+        long n = strtol(optarg, &end, 10);
+        if(*end || n < BIT_COUNT-1 || n > CARRIER_COUNT_MAX-1 || n % 8){
+          fprintf(stderr, "%s: the data carriers must be a multiple of 8 between %d and %d\n", argv[0], BIT_COUNT-1, CARRIER_COUNT_MAX-1);
+          return 1;
+        }
+        g_profile.carrier_count = n + 1;
+      } break;
+      case 'p': {
+        char* end;
+        long n = strtol(optarg, &end, 10);
+        if(*end || n < 1 || n > PHASE_BITS_MAX){
+          fprintf(stderr, "%s: the phase bits per carrier must be between 1 and %d\n", argv[0], PHASE_BITS_MAX);
+          return 1;
+        }
+        if(modulation_given && g_profile.modulation != MODULATION_PHASE){
+          fprintf(stderr, "%s: -a and -p are exclusive\n", argv[0]);
+          return 1;
+        }
+        g_profile.bits_per_carrier = n;
+        g_profile.modulation = MODULATION_PHASE;
+        modulation_given = true;
+      } break;
+      case 'f': {
+        g_sample_format = find_sample_format(optarg);
+        if(!g_sample_format){
+          fprintf(stderr, "%s: unknown sample format %s\n", argv[0], optarg);
+          return 1;
+        }
+      } break;
+      case 'j': {
+        char* end;
+        long n = strtol(optarg, &end, 10);
+        if(*end || n < 1 || n > THREAD_COUNT_MAX){
+          fprintf(stderr, "%s: the thread count must be between 1 and %d\n", argv[0], THREAD_COUNT_MAX);
+          return 1;
+        }
+        thread_count = n;
+      } break;
+      case 'g': {
+        char* end;
+        long n = strtol(optarg, &end, 10);
+        if(*end || n < 0 || n > SAMPLE_COUNT_MAX / 2){
+          fprintf(stderr, "%s: the guard interval must be between 0 and %d samples\n", argv[0], SAMPLE_COUNT_MAX / 2);
+          return 1;
+        }
+        g_profile.guard_count = n;
+      } break;
+      case 'k': g_profile.convolutional = true; break;
+      case 'n': {
+        char* end;
+        long n = strtol(optarg, &end, 10);
+        if(*end || n < SAMPLE_COUNT_MIN || n > SAMPLE_COUNT_MAX){
+          fprintf(stderr, "%s: the symbol length must be between %d and %d samples\n", argv[0], SAMPLE_COUNT_MIN, SAMPLE_COUNT_MAX);
+          return 1;
+        }
+        g_profile.sample_count = n;
+        sample_count_given = true;
+      } break;
+      case 'r': {
+        char* end;
+        unsigned long long n = strtoull(optarg, &end, 10);
+        if(*end || *optarg == '-' || n > SIZE_MAX){
+          fprintf(stderr, "%s: invalid resync interval\n", argv[0]);
+          return 1;
+        }
+        g_resync_interval = n;
+      } break;
+      case 'R': {
+        char* end;
+        long n = strtol(optarg, &end, 10);
+        if(*end || n < 1 || n > RS_DEPTH_MAX){
+          fprintf(stderr, "%s: the error correction interleaving must be between 1 and %d blocks\n", argv[0], RS_DEPTH_MAX);
+          return 1;
+        }
+        g_profile.fec_depth = n;
+      } break;
+      case 's': {
+        char* end;
+        unsigned long n = strtoul(optarg, &end, 10);
+        if(*end || *optarg == '-' || !n || n > UINT32_MAX / SAMPLE_SIZE_MAX){
+          fprintf(stderr, "%s: invalid sample rate\n", argv[0]);
+          return 1;
+        }
+        g_profile.sample_rate = n;
+      } break;
+      case 'v': g_vectored = true; break;
+      default:
+        fprintf(stderr,
+          "usage: %s [-a bits | -p bits] [-c carriers] [-f s16|s24|s32|f32] [-g samples] [-j threads] [-k] [-n samples] [-r bytes] [-R blocks] [-s rate] [-v] < file > file.wav\n"
+          "  -a  bits per carrier, sent as 2^bits amplitude levels. Defaults to 1, on / off\n"
+          "  -c  data carriers, a multiple of 8. Defaults to 8, more need longer symbols\n"
+          "  -f  sample format, defaults to s32\n"
+          "  -g  guard interval, a cyclic prefix of this many samples in front of every data symbol. Defaults to 0\n"
+          "  -j  encode the data using this many threads\n"
+          "  -k  convolutional code, which halves the data rate, but s2d can correct many errors using how sure it is of each bit\n"
+          "  -n  samples per symbol, defaults to 2 * carriers + 4, which is %d for 8\n"
+          "  -p  bits per carrier, sent as 2^bits phase shifts (2 for QPSK, 3 for 8-PSK)\n"
+          "  -r  repeat the preamble every this many bytes, so decoding can resynchronise & be split up\n"
+          "  -R  Reed-Solomon error correction, interleaving this many blocks of 223 bytes, each of which can lose 16 bytes\n"
+          "  -s  sample rate, defaults to %d\n"
+          "  -v  vectored output, write cached symbols using writev\n",
+          argv[0], SAMPLE_COUNT_DEFAULT, SAMPLE_RATE_DEFAULT
+        );
+        return 1;
+    }
+  }
+  if(!sample_count_given)
+    g_profile.sample_count = modem_sample_count_min(g_profile.carrier_count) + 1;
+  if(g_profile.sample_count < modem_sample_count_min(g_profile.carrier_count)){
+    fprintf(stderr, "%s: %d data carriers need at least %u samples per symbol\n", argv[0], g_profile.carrier_count-1, modem_sample_count_min(g_profile.carrier_count));
+    return 1;
+  }
+  if(g_profile.guard_count > g_profile.sample_count / 2){
+    fprintf(stderr, "%s: the guard interval can be at most half a symbol, %d samples\n", argv[0], g_profile.sample_count / 2);
+    return 1;
+  }
+  if((g_profile.fec_depth || g_profile.convolutional) && g_resync_interval){
+    // Resync at the start of a frame, a convolutional block, and a data symbol, so that decoding can be split up there.
+    // A frame is a whole number of convolutional blocks.
+    size_t frame = g_profile.fec_depth ? g_profile.fec_depth * RS_BLOCK_SIZE : 1;
+    if(g_profile.convolutional)
+      frame = (frame + CONV_DATA_MAX - 1) / CONV_DATA_MAX * CONV_BLOCK_SIZE;
+    size_t unit = frame;
+    while(unit % symbol_bytes())
+      unit += frame;
+    g_resync_interval = (g_resync_interval + unit - 1) / unit * unit;
+  }
+  rs_init();
+  init_wave_table();
+  init_fft_plan();
+  init_symbol_cache();
+  init_preamble();
+  detect_seekable_output();
+  write_wav_header();
+  struct modulator modulator;
+  append_preamble(NULL, &modulator);
+  if(thread_count > 1){
+    encode_parallel(&modulator, thread_count);
+  }else{
+    static unsigned char input[INPUT_BUFFER_SIZE];
+    size_t offset = 0;
+    size_t size = 0;
+    for(size_t n; (n=read_payload(input+size, sizeof(input)-size)); ){
+      // A data symbol split across reads is completed by the next one
+      size += n;
+      const size_t whole = size - size % symbol_bytes();
+      append_payload(NULL, &modulator, input, whole, offset);
+      offset += whole;
+      size -= whole;
+      memmove(input, input+whole, size);
+    }
+    append_payload(NULL, &modulator, input, size, offset);
+  }
+  append_symbol(NULL, 0);
+  append_symbol(NULL, 0);
+  output_flush();
+  finish_wav();
+  fft_plan_free(g_fft_plan);
 }
@@ -0,0 +1,217 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "fft.h"
+
+#ifndef M_PI
+#define M_PI 3.141592653589793
+#endif
+
+// A mixed radix, decimation in time FFT. The length is split into factors of 4, 2, and odd numbers,
+// which are combined by a butterfly each. Odd factors use a generic butterfly, which takes time proportional
+// to the factor, so lengths with large prime factors are slower, but still correct.
+// A real signal of even length is transformed as a complex signal of half the length, the even samples as the
+// real parts, the odd ones as the imaginary parts, which is then split up into the spectrum of the real signal.
+
+enum { FFT_FACTOR_MAX = 32 }; // Enough for any length an int can hold
+
+struct fft_plan {
+  int sample_count;
+  int size; // Of the complex transform, sample_count/2 for an even sample_count, sample_count otherwise
+  int factors[FFT_FACTOR_MAX][2]; // The radix of each stage, and the length of the transforms it combines
+  struct fft_complex* split; // Even sample_count only, e^(-2*pi*i*k/sample_count) for k from 0 to size
+  struct fft_complex twiddle[]; // e^(-2*pi*i*k/size)
+};
+
+static inline struct fft_complex cadd(struct fft_complex a, struct fft_complex b){
+  return (struct fft_complex){a.re + b.re, a.im + b.im};
+}
+
+static inline struct fft_complex csub(struct fft_complex a, struct fft_complex b){
+  return (struct fft_complex){a.re - b.re, a.im - b.im};
+}
+
+static inline struct fft_complex cmul(struct fft_complex a, struct fft_complex b){
+  return (struct fft_complex){a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re};
+}
+
+static inline struct fft_complex conj_(struct fft_complex a){
+  return (struct fft_complex){a.re, -a.im};
+}
+
+static inline struct fft_complex unit(double cycles){
+  return (struct fft_complex){cos(2*M_PI*cycles), -sin(2*M_PI*cycles)};
+}
+
+struct fft_plan* fft_plan_create(int sample_count){
+  if(sample_count < 1)
+    return NULL;
+  const int size = sample_count % 2 ? sample_count : sample_count / 2;
+  const int split_count = sample_count % 2 ? 0 : size + 1;
+  struct fft_plan*const plan = malloc(sizeof(*plan) + sizeof(struct fft_complex) * (size + split_count));
+  if(!plan)
+    return NULL;
+  plan->sample_count = sample_count;
+  plan->size = size;
+  for(int k=0; k<size; k++)
+    plan->twiddle[k] = unit((double)k / size);
+  plan->split = 0;
+  if(split_count){
+    plan->split = plan->twiddle + size;
+    for(int k=0; k<split_count; k++)
+      plan->split[k] = unit((double)k / sample_count);
+  }
+  // 4s first, then 2s, then odd factors, a prime is its own factor
+  int p = 4;
+  int i = 0;
+  for(int n=size; n>1; i++){
+    while(n % p){
+      p = p == 4 ? 2 : p == 2 ? 3 : p + 2;
+      if(p * p > n)
+        p = n;
+    }
+    n /= p;
+    plan->factors[i][0] = p;
+    plan->factors[i][1] = n;
+  }
+  if(!i){ // A transform of 1 sample does nothing
+    plan->factors[0][0] = 1;
+    plan->factors[0][1] = 1;
+  }
+  return plan;
+}
+
+void fft_plan_free(struct fft_plan* plan){
+  free(plan);
+}
+
+int fft_plan_sample_count(const struct fft_plan* plan){
+  return plan->sample_count;
+}
+
+static void butterfly_2(const struct fft_plan* plan, struct fft_complex* out, int stride, int m){
+  for(int k=0; k<m; k++){
+    const struct fft_complex t = cmul(out[m+k], plan->twiddle[k*stride]);
+    out[m+k] = csub(out[k], t);
+    out[k] = cadd(out[k], t);
+  }
+}
+
+static void butterfly_4(const struct fft_plan* plan, struct fft_complex* out, int stride, int m){
+  for(int k=0; k<m; k++){
+    const struct fft_complex a = cmul(out[k+m], plan->twiddle[k*stride]);
+    const struct fft_complex b = cmul(out[k+2*m], plan->twiddle[k*stride*2]);
+    const struct fft_complex c = cmul(out[k+3*m], plan->twiddle[k*stride*3]);
+    const struct fft_complex even = csub(out[k], b);
+    const struct fft_complex sum = cadd(a, c);
+    const struct fft_complex diff = csub(a, c);
+    out[k] = cadd(out[k], b);
+    out[k+2*m] = csub(out[k], sum);
+    out[k] = cadd(out[k], sum);
+    // even -/+ i * diff
+    out[k+m] = (struct fft_complex){even.re + diff.im, even.im - diff.re};
+    out[k+3*m] = (struct fft_complex){even.re - diff.im, even.im + diff.re};
+  }
+}
+
+static void butterfly_generic(const struct fft_plan* plan, struct fft_complex* out, int stride, int m, int p){
+  struct fft_complex scratch[p];
+  for(int u=0; u<m; u++){
+    for(int q=0; q<p; q++)
+      scratch[q] = out[u+q*m];
+    for(int q1=0; q1<p; q1++){
+      const int k = u + q1*m;
+      struct fft_complex sum = scratch[0];
+      int t = 0;
+      for(int q=1; q<p; q++){
+        t += stride * k;
+        if(t >= plan->size)
+          t -= plan->size;
+        sum = cadd(sum, cmul(scratch[q], plan->twiddle[t]));
+      }
+      out[k] = sum;
+    }
+  }
+}
+
+// Transforms the samples in[0], in[stride], ... into out, using the factors from the given one on
+static void transform(const struct fft_plan* plan, struct fft_complex* out, const struct fft_complex* in, int stride, int factor){
+  const int p = plan->factors[factor][0];
+  const int m = plan->factors[factor][1];
+  if(m == 1){
+    for(int j=0; j<p; j++)
+      out[j] = in[j*stride];
+  }else{
+    for(int j=0; j<p; j++)
+      transform(plan, out + j*m, in + j*stride, stride*p, factor+1);
+  }
+  switch(p){
+    case 1: break;
+    case 2: butterfly_2(plan, out, stride, m); break;
+    case 4: butterfly_4(plan, out, stride, m); break;
+    default: butterfly_generic(plan, out, stride, m, p); break;
+  }
+}
+
+void fft_forward(const struct fft_plan* plan, const double signal[], struct fft_complex spectrum[]){
+  const int size = plan->size;
+  if(size < 1) // Never the case, but the compiler can't know that the buffers get filled otherwise
+    return;
+  struct fft_complex in[size];
+  struct fft_complex out[size];
+  if(!plan->split){
+    for(int t=0; t<size; t++)
+      in[t] = (struct fft_complex){signal[t], 0};
+    transform(plan, out, in, 1, 0);
+    for(int k=0; k<=size/2; k++)
+      spectrum[k] = out[k];
+    return;
+  }
+  for(int t=0; t<size; t++)
+    in[t] = (struct fft_complex){signal[2*t], signal[2*t+1]};
+  transform(plan, out, in, 1, 0);
+  for(int k=0; k<=size; k++){
+    // The spectra of the even and the odd samples
+    const struct fft_complex a = out[k % size];
+    const struct fft_complex b = conj_(out[(size - k) % size]);
+    const struct fft_complex even = {(a.re + b.re) / 2, (a.im + b.im) / 2};
+    const struct fft_complex odd = {(a.im - b.im) / 2, (b.re - a.re) / 2};
+    spectrum[k] = cadd(even, cmul(plan->split[k], odd));
+  }
+}
+
+// Bin k of the spectrum, with the imaginary parts a real signal can't have dropped
+static inline struct fft_complex real_bin(const struct fft_plan* plan, const struct fft_complex spectrum[], int k){
+  if(!k || k * 2 == plan->sample_count)
+    return (struct fft_complex){spectrum[k].re, 0};
+  return spectrum[k];
+}
+
+void fft_inverse(const struct fft_plan* plan, const struct fft_complex spectrum[], double signal[]){
+  const int size = plan->size;
+  if(size < 1) // Never the case, but the compiler can't know that the buffers get filled otherwise
+    return;
+  // The inverse transform is the conjugate of the forward transform of the conjugate
+  struct fft_complex in[size];
+  struct fft_complex out[size];
+  if(!plan->split){
+    for(int k=0; k<size; k++)
+      in[k] = k <= size/2 ? conj_(real_bin(plan, spectrum, k)) : real_bin(plan, spectrum, size - k);
+    transform(plan, out, in, 1, 0);
+    for(int t=0; t<size; t++)
+      signal[t] = out[t].re;
+    return;
+  }
+  for(int k=0; k<size; k++){
+    // Combine the spectra of the even and the odd samples again
+    const struct fft_complex a = real_bin(plan, spectrum, k);
+    const struct fft_complex b = conj_(real_bin(plan, spectrum, size - k));
+    const struct fft_complex odd = cmul(conj_(plan->split[k]), csub(a, b));
+    in[k] = conj_((struct fft_complex){a.re + b.re - odd.im, a.im + b.im + odd.re});
+  }
+  transform(plan, out, in, 1, 0);
+  for(int t=0; t<size; t++){
+    signal[2*t] = out[t].re;
+    signal[2*t+1] = -out[t].im;
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <stdbool.h>
+
+// Fast fourier transforms of real signals of any length, shared by d2s and s2d.
+// A plan holds the factors and twiddle factors for one length, and is reused for every symbol of a stream.
+// Plans are only read once made, so one plan can be used by several threads at once.
+
+struct fft_complex {
+  double re;
+  double im;
+};
+
+struct fft_plan;
+
+// Returns NULL if memory is exhausted, or sample_count is less than 1
+struct fft_plan* fft_plan_create(int sample_count);
+void fft_plan_free(struct fft_plan* plan);
+int fft_plan_sample_count(const struct fft_plan* plan);
+
+// Bin k of a signal x of n samples is the sum of x[t] * e^(-2*pi*i*k*t/n). Only bins 0 to n/2 are stored,
+// the others are the complex conjugates of those for a real signal.
+void fft_forward(const struct fft_plan* plan, const double signal[], struct fft_complex spectrum[]);
+// The inverse, without the 1/n normalization: sample t is the sum of spectrum[k] * e^(2*pi*i*k*t/n) over all n bins,
+// the bins above n/2 being the complex conjugates of the given ones. The imaginary parts of bin 0, and of bin n/2
+// for an even n, are ignored.
+void fft_inverse(const struct fft_plan* plan, const struct fft_complex spectrum[], double signal[]);
+
+#endif
@@ -0,0 +1,95 @@
+#include "modem.h"
+#include "rs.h"
+
+const struct modem_profile modem_profile_default = {
+  .sample_rate = SAMPLE_RATE_DEFAULT,
+  .sample_count = SAMPLE_COUNT_DEFAULT,
+  .carrier_count = BIT_COUNT,
+  .bits_per_carrier = 1,
+  .modulation = MODULATION_AMPLITUDE,
+  .guard_count = 0,
+  .fec_depth = 0,
+  .convolutional = 0,
+};
+
+// Polynomial x^8+x^2+x+1
+static uint8_t crc8(const unsigned char* data, size_t size){
+  uint8_t crc = 0;
+  for(size_t i=0; i<size; i++){
+    crc ^= data[i];
+    for(int b=0; b<8; b++)
+      crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+size_t modem_profile_encode(const struct modem_profile* profile, unsigned char record[MODEM_PROFILE_RECORD_MAX]){
+  unsigned char* p = record + 1;
+  for(int i=0; i<4; i++)
+    *p++ = profile->sample_rate >> i*8;
+  *p++ = profile->sample_count;
+  *p++ = profile->sample_count >> 8;
+  *p++ = profile->carrier_count;
+  *p++ = profile->bits_per_carrier;
+  *p++ = profile->modulation;
+  *p++ = profile->guard_count;
+  *p++ = profile->guard_count >> 8;
+  *p++ = profile->fec_depth;
+  *p++ = profile->convolutional;
+  record[0] = p - record - 1;
+  *p = crc8(record, p - record);
+  return p - record + 1;
+}
+
+size_t modem_profile_remaining(const unsigned char* record, size_t size){
+  if(!size)
+    return 1;
+  return 1 + record[0] + 1 - size;
+}
+
+const char* modem_profile_decode(struct modem_profile* profile, const unsigned char* record, size_t size){
+  if(!size || modem_profile_remaining(record, size) || crc8(record, size-1) != record[size-1])
+    return "damaged profile record";
+  *profile = modem_profile_default;
+  const unsigned char* field = record + 1;
+  const size_t length = record[0];
+  if(length >= 4)
+    profile->sample_rate = field[0] | field[1] << 8 | field[2] << 16 | (uint32_t)field[3] << 24;
+  if(length >= 6)
+    profile->sample_count = field[4] | field[5] << 8;
+  if(length >= 7)
+    profile->carrier_count = field[6];
+  if(length >= 8)
+    profile->bits_per_carrier = field[7];
+  if(length >= 9)
+    profile->modulation = field[8];
+  if(length >= 11)
+    profile->guard_count = field[9] | field[10] << 8;
+  if(length >= 12)
+    profile->fec_depth = field[11];
+  if(length >= 13)
+    profile->convolutional = field[12];
+  return modem_profile_check(profile);
+}
+
+const char* modem_profile_check(const struct modem_profile* profile){
+  if(!profile->sample_rate)
+    return "invalid sample rate";
+  if(profile->carrier_count < BIT_COUNT || profile->carrier_count > CARRIER_COUNT_MAX || (profile->carrier_count - 1) % 8)
+    return "unsupported carrier count";
+  if(profile->sample_count < modem_sample_count_min(profile->carrier_count) || profile->sample_count > SAMPLE_COUNT_MAX)
+    return "symbol length out of range";
+  if(profile->bits_per_carrier < 1 || profile->bits_per_carrier > BITS_PER_CARRIER_MAX)
+    return "unsupported number of bits per carrier";
+  if(profile->modulation >= MODULATION_COUNT)
+    return "unsupported modulation";
+  if(profile->modulation == MODULATION_PHASE && profile->bits_per_carrier > PHASE_BITS_MAX)
+    return "unsupported number of phases";
+  if(profile->guard_count > profile->sample_count / 2)
+    return "guard interval longer than half a symbol";
+  if(profile->fec_depth > RS_DEPTH_MAX)
+    return "unsupported error correction interleaving";
+  if(profile->convolutional > 1)
+    return "unsupported convolutional code";
+  return NULL;
+}
@@ -0,0 +1,90 @@
+#ifndef MODEM_H
+#define MODEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Parameters of a transmission, shared by d2s and s2d.
+// The encoder sends them as a profile record in the preamble, right before the start of data.
+// Streams without one were made before there was a choice, the defaults apply to them.
+
+// Carrier c has c+1 cycles per symbol, the sync signal is carrier 0. The preamble and control symbols only ever use
+// the lowest BIT_COUNT carriers, as one byte and the sync signal, the data symbols may use more.
+enum {
+  BIT_COUNT = 9, // Carriers: 8 data bits and the sync signal
+  CARRIER_COUNT_MAX = 128 + 1,
+  SAMPLE_COUNT_MIN = BIT_COUNT*2+1, // We need at least this many samples for our data
+  SAMPLE_COUNT_DEFAULT = SAMPLE_COUNT_MIN + 1, // We add a few extra samples, this gives some tolerance
+  SAMPLE_COUNT_MAX = 1024,
+  SAMPLE_RATE_DEFAULT = 44100,
+  BITS_PER_CARRIER_MAX = 4, // Amplitude levels or phases per carrier are 2^bits_per_carrier
+  PHASE_BITS_MAX = 3, // 8-PSK, more phases get too close to each other to tell apart
+  SYMBOL_BYTES_MAX = BITS_PER_CARRIER_MAX * (CARRIER_COUNT_MAX-1) / 8,
+};
+
+#define SYNC_SIGNAL 0x100u
+#define RESYNC_SIGNAL 0xFFu // All data frequencies, but no sync signal. A new preamble follows.
+#define PROFILE_SIGNAL 'P' // The profile record follows
+#define START_SIGNAL '>' // Signify start of data
+// With multiple bytes per symbol, says how many bytes, in the low bits, the following last data symbol holds.
+// Like all control symbols, it has no sync signal.
+#define END_SIGNAL 0x80u
+
+enum modem_modulation {
+  MODULATION_AMPLITUDE, // On / off keying, or multiple amplitude levels
+  MODULATION_PHASE, // Differential phase shift keying. Each symbol shifts a carriers phase, relative to the sync signal.
+  MODULATION_COUNT
+};
+
+struct modem_profile {
+  uint32_t sample_rate;
+  uint16_t sample_count; // Samples per symbol
+  uint8_t carrier_count; // Including the sync signal. The data carriers are a multiple of 8.
+  uint8_t bits_per_carrier; // 1 for on / off keying, more for multiple amplitude levels
+  uint8_t modulation; // enum modem_modulation
+  // Samples of cyclic prefix in front of each symbol after the start of data: a copy of the end of the symbol.
+  // The decoder skips most of it, so that a symbol that arrives a bit early or late, or an echo of the previous one,
+  // doesn't spill into the samples it uses.
+  uint16_t guard_count;
+  // Reed-Solomon blocks interleaved per frame of payload, 0 without forward error correction. See rs.h.
+  uint8_t fec_depth;
+  // Whether the payload, with its Reed-Solomon blocks, is sent convolutionally coded. See conv.h.
+  uint8_t convolutional;
+};
+
+extern const struct modem_profile modem_profile_default;
+
+// The record is a length byte, the fields, and a CRC-8 of both. Fields a record is too short for keep their default,
+// so new fields can be appended without breaking older records.
+enum { MODEM_PROFILE_RECORD_MAX = 1 + 255 + 1 };
+
+size_t modem_profile_encode(const struct modem_profile* profile, unsigned char record[MODEM_PROFILE_RECORD_MAX]);
+// How many more bytes the record needs, 0 once it is complete
+size_t modem_profile_remaining(const unsigned char* record, size_t size);
+// These return an error message, or NULL on success
+const char* modem_profile_decode(struct modem_profile* profile, const unsigned char* record, size_t size);
+const char* modem_profile_check(const struct modem_profile* profile);
+
+// Symbols need more than 2 samples per cycle of the highest carrier, and one more, like with SAMPLE_COUNT_MIN
+static inline unsigned modem_sample_count_min(unsigned carrier_count){
+  return carrier_count*2+1;
+}
+
+// Payload bytes per data symbol. With n data carriers, bit i of byte j is held by data carrier j%(n/8)*8+i,
+// as bit j/(n/8) of its level. Data carrier b is carrier n-b, like the bits of a control symbol.
+static inline unsigned modem_symbol_bytes(const struct modem_profile* profile){
+  return profile->bits_per_carrier * (profile->carrier_count - 1) / 8;
+}
+
+// Amplitude levels and phases use a gray code, so that mistaking a level for a neighbouring one only affects one bit
+static inline unsigned modem_level_to_bits(unsigned level){
+  return level ^ level >> 1;
+}
+
+static inline unsigned modem_bits_to_level(unsigned bits){
+  for(unsigned shift=1; shift<BITS_PER_CARRIER_MAX; shift<<=1)
+    bits ^= bits >> shift;
+  return bits;
+}
+
+#endif
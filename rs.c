@@ -0,0 +1,244 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rs.h"
+
+// GF(256) with the polynomial x^8+x^4+x^3+x^2+1, which has x, or 2, as a primitive element a.
+// The generator polynomial of the code has the roots a^0 to a^(RS_PARITY-1). The first byte of a block is the
+// coefficient of the highest power, the parity bytes are the remainder of the data times x^RS_PARITY divided by it.
+
+static uint8_t gf_exp[2*255]; // a^i, twice, so that the sum of two logarithms needs no modulo
+static uint8_t gf_log[256]; // gf_log[0] is unused
+// Products with each byte, for the parts that run over every byte: the coefficients of x^(RS_PARITY-1) down to x^0
+// of the generator polynomial, whose coefficient of x^RS_PARITY is 1, and the roots
+static uint8_t generator_product[256][RS_PARITY];
+static uint8_t root_product[RS_PARITY][256];
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b){
+  if(!a || !b)
+    return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_div(uint8_t a, uint8_t b){
+  if(!a)
+    return 0;
+  return gf_exp[gf_log[a] + 255 - gf_log[b]];
+}
+
+// a^i, for i from 0 to 254
+static inline uint8_t gf_pow(int i){
+  return gf_exp[i];
+}
+
+void rs_init(void){
+  unsigned x = 1;
+  for(int i=0; i<255; i++){
+    gf_exp[i] = gf_exp[i+255] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if(x & 0x100)
+      x ^= 0x11D;
+  }
+  // Multiply (x - a^i) together
+  uint8_t g[RS_PARITY+1] = {1};
+  for(int i=0; i<RS_PARITY; i++){
+    for(int j=i+1; j>0; j--)
+      g[j] = g[j-1] ^ gf_mul(g[j], gf_pow(i));
+    g[0] = gf_mul(g[0], gf_pow(i));
+  }
+  for(int x=0; x<256; x++){
+    for(int j=0; j<RS_PARITY; j++){
+      generator_product[x][j] = gf_mul(x, g[RS_PARITY-1-j]);
+      root_product[j][x] = gf_mul(x, gf_pow(j));
+    }
+  }
+}
+
+void rs_encode(const unsigned char* data, size_t size, unsigned char parity[RS_PARITY]){
+  // A shift register dividing by the generator polynomial, parity[0] holds the highest power
+  memset(parity, 0, RS_PARITY);
+  for(size_t i=0; i<size; i++){
+    const uint8_t*const product = generator_product[data[i] ^ parity[0]];
+    for(int j=0; j<RS_PARITY-1; j++)
+      parity[j] = parity[j+1] ^ product[j];
+    parity[RS_PARITY-1] = product[RS_PARITY-1];
+  }
+}
+
+int rs_decode(unsigned char* block, size_t size){
+  return rs_decode_erasures(block, size, NULL, 0);
+}
+
+int rs_decode_erasures(unsigned char* block, size_t size, const int erasures[], int erasure_count){
+  if(size <= RS_PARITY || size > RS_BLOCK_SIZE || erasure_count > RS_PARITY)
+    return -1;
+  // The syndromes are the block evaluated at the roots of the generator polynomial, all 0 without errors
+  // All of them at once, they are independent of each other, but each depends on the last byte
+  uint8_t syndrome[RS_PARITY] = {0};
+  for(size_t p=0; p<size; p++)
+    for(int i=0; i<RS_PARITY; i++)
+      syndrome[i] = root_product[i][syndrome[i]] ^ block[p];
+  bool damaged = false;
+  for(int i=0; i<RS_PARITY; i++)
+    damaged |= syndrome[i];
+  if(!damaged)
+    return 0;
+  // Berlekamp-Massey finds the error locator polynomial, whose roots are the inverses of a^(position of an error),
+  // position 0 being the last byte. It starts out from the one of the erasures, which are known errors, so it only has
+  // to find the others, from the syndromes the erasures didn't use up.
+  uint8_t locator[RS_PARITY+1] = {1};
+  for(int k=0; k<erasure_count; k++){
+    const uint8_t root = gf_pow(size - 1 - erasures[k]);
+    for(int i=k+1; i>0; i--)
+      locator[i] ^= gf_mul(locator[i-1], root);
+  }
+  uint8_t previous[RS_PARITY+1];
+  memcpy(previous, locator, sizeof(previous));
+  int degree = erasure_count;
+  int shift = 1;
+  uint8_t previous_discrepancy = 1;
+  for(int n=erasure_count; n<RS_PARITY; n++){
+    uint8_t discrepancy = syndrome[n];
+    for(int i=1; i<=degree; i++)
+      discrepancy ^= gf_mul(locator[i], syndrome[n-i]);
+    if(!discrepancy){
+      shift++;
+      continue;
+    }
+    const uint8_t factor = gf_div(discrepancy, previous_discrepancy);
+    uint8_t old[RS_PARITY+1];
+    memcpy(old, locator, sizeof(old));
+    for(int i=0; i+shift<=RS_PARITY; i++)
+      locator[i+shift] ^= gf_mul(factor, previous[i]);
+    if(2 * degree <= n + erasure_count){
+      degree = n + 1 + erasure_count - degree;
+      memcpy(previous, old, sizeof(previous));
+      previous_discrepancy = discrepancy;
+      shift = 1;
+    }else{
+      shift++;
+    }
+  }
+  // Each error takes 2 parity bytes to correct, an erasure only 1
+  if(2 * degree - erasure_count > RS_PARITY)
+    return -1;
+  // The error evaluator polynomial, the syndromes times the locator, modulo x^RS_PARITY
+  uint8_t evaluator[RS_PARITY];
+  for(int i=0; i<RS_PARITY; i++){
+    uint8_t e = 0;
+    for(int j=0; j<=i && j<=degree; j++)
+      e ^= gf_mul(syndrome[i-j], locator[j]);
+    evaluator[i] = e;
+  }
+  // Chien search for the roots, within the block only, and Forney's formula for the error values
+  int position[RS_PARITY];
+  uint8_t value[RS_PARITY];
+  int found = 0;
+  for(size_t d=0; d<size; d++){
+    const int inverse = (255 - d) % 255; // Logarithm of a^-d
+    uint8_t l = 0, derivative = 0, e = 0;
+    for(int i=degree; i>=0; i--){
+      l = gf_mul(l, gf_pow(inverse)) ^ locator[i];
+      if(i % 2)
+        derivative ^= gf_mul(locator[i], gf_pow(inverse * (i - 1) % 255));
+    }
+    if(l)
+      continue;
+    if(found == degree || !derivative)
+      return -1;
+    for(int i=RS_PARITY-1; i>=0; i--)
+      e = gf_mul(e, gf_pow(inverse)) ^ evaluator[i];
+    position[found] = size - 1 - d;
+    value[found++] = gf_mul(gf_pow(d), gf_div(e, derivative));
+  }
+  if(found != degree)
+    return -1;
+  for(int i=0; i<found; i++)
+    block[position[i]] ^= value[i];
+  return found;
+}
+
+// Blocks used by a frame holding size bytes of data
+static size_t frame_blocks(int depth, size_t size){
+  const size_t blocks = (size + RS_DATA_MAX - 1) / RS_DATA_MAX;
+  return blocks < (size_t)depth ? blocks : (size_t)depth;
+}
+
+size_t rs_frame_size(int depth, size_t size){
+  return size + RS_PARITY * frame_blocks(depth, size);
+}
+
+size_t rs_frame_data_size(int depth, size_t size){
+  // The frame size grows with the data size, so at most one of them fits
+  for(size_t blocks=1; blocks<=(size_t)depth && blocks*RS_PARITY<size; blocks++){
+    const size_t data_size = size - blocks * RS_PARITY;
+    if(data_size <= depth * (size_t)RS_DATA_MAX && frame_blocks(depth, data_size) == blocks)
+      return data_size;
+  }
+  return 0;
+}
+
+void rs_frame_encode(int depth, const unsigned char* data, size_t size, unsigned char* frame){
+  const size_t blocks = frame_blocks(depth, size);
+  for(size_t b=0, offset=0; b<blocks; b++){
+    const size_t count = size / blocks + (b < size % blocks);
+    unsigned char parity[RS_PARITY];
+    rs_encode(data + offset, count, parity);
+    for(size_t i=0; i<count; i++)
+      frame[i*blocks+b] = data[offset+i];
+    for(size_t i=0; i<RS_PARITY; i++)
+      frame[(count+i)*blocks+b] = parity[i];
+    offset += count;
+  }
+}
+
+// Generalized minimum distance decoding: with the least reliable bytes erased, a block can be corrected even with more
+// than RS_PARITY/2 errors, as long as those are among them. Erasing a byte that was right wastes a parity byte though,
+// so increasingly many are tried. Stops at RS_PARITY/2, beyond that too few parity bytes are left to tell whether
+// a correction is right. Returns the number of corrected bytes, or -1 if that didn't help.
+static int decode_least_reliable(unsigned char* block, size_t size, const uint8_t reliability[]){
+  // The least reliable bytes, least first
+  int erasures[RS_PARITY/2];
+  bool erased[RS_BLOCK_SIZE] = {false};
+  for(int k=0; k<RS_PARITY/2; k++){
+    int least = -1;
+    for(size_t i=0; i<size; i++)
+      if(!erased[i] && (least < 0 || reliability[i] < reliability[least]))
+        least = i;
+    erased[least] = true;
+    erasures[k] = least;
+  }
+  for(int count=2; count<=RS_PARITY/2; count+=2){
+    unsigned char attempt[RS_BLOCK_SIZE];
+    memcpy(attempt, block, size);
+    const int corrected = rs_decode_erasures(attempt, size, erasures, count);
+    if(corrected >= 0){
+      memcpy(block, attempt, size);
+      return corrected;
+    }
+  }
+  return -1;
+}
+
+int rs_frame_decode(int depth, const unsigned char* frame, const uint8_t reliability[], size_t size, unsigned char* data){
+  const size_t data_size = rs_frame_data_size(depth, size);
+  const size_t blocks = frame_blocks(depth, data_size);
+  int failures = 0;
+  for(size_t b=0, offset=0; b<blocks; b++){
+    const size_t count = data_size / blocks + (b < data_size % blocks);
+    unsigned char block[RS_BLOCK_SIZE];
+    uint8_t block_reliability[RS_BLOCK_SIZE];
+    for(size_t i=0; i<count+RS_PARITY; i++){
+      block[i] = frame[i*blocks+b];
+      if(reliability)
+        block_reliability[i] = reliability[i*blocks+b];
+    }
+    if(rs_decode(block, count + RS_PARITY) < 0 && (!reliability || decode_least_reliable(block, count + RS_PARITY, block_reliability) < 0))
+      failures++;
+    memcpy(data + offset, block, count);
+    offset += count;
+  }
+  return failures;
+}
@@ -0,0 +1,43 @@
+#ifndef RS_H
+#define RS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reed-Solomon (255,223) forward error correction over GF(256), shared by d2s and s2d.
+// A block of up to 223 data bytes gets 32 parity bytes, which correct up to 16 damaged bytes anywhere in it.
+// Blocks with less data are shortened: the missing leading data bytes are taken to be 0, and aren't sent.
+
+enum {
+  RS_BLOCK_SIZE = 255,
+  RS_PARITY = 32,
+  RS_DATA_MAX = RS_BLOCK_SIZE - RS_PARITY,
+  RS_DEPTH_MAX = 32, // Blocks interleaved per frame
+};
+
+// Sets up the GF(256) tables. Must be called before anything else here, and before any threads use it.
+void rs_init(void);
+
+void rs_encode(const unsigned char* data, size_t size, unsigned char parity[RS_PARITY]);
+// Corrects a block of size bytes, data followed by parity, in place.
+// Returns the number of corrected bytes, or -1 if there are too many errors to correct.
+int rs_decode(unsigned char* block, size_t size);
+// Like rs_decode, with the bytes at the positions in erasures known to be unreliable. An erasure takes only one parity
+// byte to correct, rather than two for an error anywhere, so 2 * errors + erasure_count may be up to RS_PARITY.
+int rs_decode_erasures(unsigned char* block, size_t size, const int erasures[], int erasure_count);
+
+// A frame interleaves depth blocks byte by byte, so that a burst of damaged bytes, like a whole symbol,
+// is spread over all of them. The last frame of a stream holds less data: it uses only as many blocks as needed,
+// which are shortened evenly. The first of them hold one more data byte if it doesn't divide evenly.
+
+// The size of a frame holding size bytes of data, at most depth * RS_DATA_MAX
+size_t rs_frame_size(int depth, size_t size);
+// The data a frame of size bytes holds, 0 if no frame has that size
+size_t rs_frame_data_size(int depth, size_t size);
+void rs_frame_encode(int depth, const unsigned char* data, size_t size, unsigned char* frame);
+// Corrects the frame, and stores its data. Returns the number of blocks with too many errors to correct,
+// their data is stored as received. reliability, if given, is how sure the receiver is of each byte of the frame,
+// the higher the surer. Blocks with too many errors are tried again with their least reliable bytes erased.
+int rs_frame_decode(int depth, const unsigned char* frame, const uint8_t reliability[], size_t size, unsigned char* data);
+
+#endif
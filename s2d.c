@@ -1,32 +1,94 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <tgmath.h>
 #include <stdio.h>
 
+#include "conv.h"
+#include "fft.h"
+#include "modem.h"
+#include "rs.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FOURIER_AVX
+#include <immintrin.h>
+#endif
+
 #ifndef M_PI
 #define M_PI 3.141592653589793
 #endif
 
-enum {
-  BIT_COUNT = 9,
-  SAMPLE_COUNT_MIN = BIT_COUNT*2+1, // We need at least this many samples for our data
-};
-
 //////////////////////////////////////////////////////////////
 // A fourier transform, Based on discrete fourier transform //
 //////////////////////////////////////////////////////////////
 
+enum fourier_engine {
+  FOURIER_DFT, // Correlates every sample with an oscillator per frequency
+  FOURIER_GOERTZEL, // A goertzel filter per frequency, only 1 multiply-add per frequency & sample
+  FOURIER_FFT, // Keeps the samples, and transforms them all at once. Only log(samples) operations per sample.
+};
+
+// Lanes are padded, so that the vectorized kernels never need to handle a remainder, see struct fourier.
+// The padding is used for additional frequencies, which are calculated but not otherwise used.
+#define FOURIER_STRIDE(N) (((N)+7)/8*8)
+
 struct fourier {
   short i; // Current sample index for compareason frequencies.
-  const short frequency_count;
+  short frequency_count; // See fourier_set_frequency_count
   // Must be at least frequency_count*2+1
   // Usually, people use an FFT and infer frequency_count from sample_count or vice versa,
   // but we want to handle cases where we've got more samples than we need.
   short sample_count;
-  float sincos_components[0]; // Nonstandard, but necessary for how we use this, for alignment & padding reasons
+  short rotation_sample_count; // The sample_count the rotations were computed for
+  enum fourier_engine engine;
+  // FFT engine: the plan for sample_count, and the samples so far. Made once needed, see fourier_fft_prepare.
+  struct fft_plan* plan;
+  float* window;
+  // Goertzel engine: 2 cos of the rotation per sample, and the last 2 filter outputs, of each frequency. Rounded to
+  // floats, the filters of long symbols with many carriers stray too far from what the DFT gets.
+  double goertzel[3][FOURIER_STRIDE(CARRIER_COUNT_MAX)];
+  float components[0]; // Nonstandard, but necessary for how we use this, for alignment & padding reasons
+};
+
+// Each frequency gets an entry in each of these lanes, so components is float[FOURIER_LANE_COUNT][FOURIER_STRIDE(frequency_count)].
+// Instead of calculating sin & cos for every frequency of every sample, the DFT engine has an oscillator per frequency,
+// which is rotated by a fixed angle every sample. The goertzel engine keeps its filters in fourier->goertzel instead.
+// Either way, the sine & cosine components are complete once fourier_add_sample returns true.
+
+enum {
+  FOURIER_SIN, // sine component of the frequency
+  FOURIER_COS, // cosine component of the frequency
+  FOURIER_STATE_1, // DFT: sine of the oscillator at the current sample
+  FOURIER_STATE_2, // DFT: cosine of the oscillator at the current sample
+  FOURIER_ROT_SIN, // rotation per sample
+  FOURIER_ROT_COS,
+  FOURIER_LANE_COUNT
+};
+
+enum {
+  GOERTZEL_COS2, // 2 cos of the rotation per sample
+  GOERTZEL_STATE_1, // Last output
+  GOERTZEL_STATE_2, // Output before that
+};
+
+enum { FOURIER_BATCH_WINDOWS = 64 };
+
+struct fourier_batch {
+  short sample_count; // The sample_count the basis was computed for
+  short columns; // 2 * FOURIER_STRIDE(frequency_count), a sine and a cosine lane
+  float* basis; // float[sample_count][2][stride]
+  float* windows; // float[FOURIER_BATCH_WINDOWS][sample_count]
+  float* results; // float[FOURIER_BATCH_WINDOWS][2][stride]
 };
 
 #define DECODER_STATE \
@@ -34,7 +96,11 @@ struct fourier {
   X(DECODER_DETECT_POLARITY) \
   X(DECODER_DETECT_WAVE_FIRST_HALF) \
   X(DECODER_DETECT_WAVE_SECOND_HALF) \
+  X(DECODER_DETECT_PERIOD_FIRST_HALF) \
+  X(DECODER_DETECT_PERIOD_SECOND_HALF) \
   X(DECODER_DETECT_CALIBRATE) \
+  X(DECODER_READ_PROFILE) \
+  X(DECODER_TRAIN_LEVELS) \
   X(DECODER_DECODE_DATA) \
   X(DECODER_EOF)
 
@@ -52,6 +118,46 @@ const char*const decoder_state_str[] = {
 
 struct decoder {
   enum decoder_state state;
+  bool batch_windows; // Correlate whole windows of data symbols at once, see decoder_decode_windows
+  struct fourier_batch batch;
+  uint32_t sample_rate; // Of the recording, 0 if unknown
+  struct modem_profile profile;
+  uint16_t profile_size;
+  unsigned char profile_record[MODEM_PROFILE_RECORD_MAX];
+  // Multiple amplitude levels: the ratio of each level of each data carrier to the sync signal while training,
+  // the thresholds between them after that
+  uint8_t train_level;
+  float level_threshold[CARRIER_COUNT_MAX-1][1<<BITS_PER_CARRIER_MAX];
+  // Phase shift keying: the phase of each frequency in the last symbol, in cycles.
+  // The first symbol after the start of data only sets it.
+  bool phase_reference;
+  float carrier_phase[CARRIER_COUNT_MAX];
+  // Samples of the cyclic prefix of each data symbol, and how many are left to skip in front of the next one
+  uint16_t guard;
+  uint16_t guard_left;
+  // Payload of the last data symbol
+  uint8_t symbol_limit; // How many bytes the next data symbol holds, see END_SIGNAL
+  uint8_t symbol_size;
+  unsigned char symbol[SYMBOL_BYTES_MAX];
+  conv_soft symbol_soft[SYMBOL_BYTES_MAX * 8]; // Soft decisions of its bits, see decoder_soft_output
+  // The nearest boundaries above and below each level where each bit flips, see decoder_soft_boundaries
+  int8_t flip_above[1<<BITS_PER_CARRIER_MAX][BITS_PER_CARRIER_MAX];
+  int8_t flip_below[1<<BITS_PER_CARRIER_MAX][BITS_PER_CARRIER_MAX];
+  // How far the measurements of data symbols stray from the levels they were taken for. A running average of the mean
+  // square, in halves of the distance between neighbouring levels, 0 until the first data symbol.
+  float noise;
+  // Forward error correction: the interleaving depth, convolutional coding and the symbol size its interleaving is laid
+  // out for, taken from the profile at the start of data, and the payload received of the current Reed-Solomon frame and convolutional block. The payload is collected
+  // after decoding, by which time a resync may have already reset the profile. d2s starts frames at resyncs, see decoder_realign.
+  uint8_t fec_depth;
+  bool convolutional;
+  uint8_t conv_symbol_size;
+  uint16_t fec_size;
+  uint16_t conv_size; // Bytes
+  unsigned char fec_frame[RS_DEPTH_MAX * RS_BLOCK_SIZE];
+  uint8_t fec_reliability[RS_DEPTH_MAX * RS_BLOCK_SIZE]; // The least sure bit of each byte, if not convolutionally coded
+  conv_soft conv_block[CONV_BLOCK_SIZE * 8];
+  bool resynced; // Since the payload was last written
   // Polarity and level of signal
   bool polarity;
   int16_t phase;
@@ -60,13 +166,18 @@ struct decoder {
   uint16_t baseline;
   uint16_t signal_max;
   uint16_t signal_min;
+  // While measuring the period of the preamble: the previous sample, and how long before the sample that noticed it
+  // the signal crossed the middle the first time, in samples
+  uint16_t last_sample;
+  float crossing;
   struct { // Fourier state
     struct fourier fourier;
-    // sine / cosine components of frequency signal. Only 1..7, excluding frequency 0 (amplitude), excluding frequencies 10..17
-    float sincos_components[BIT_COUNT][2];
+    // sine / cosine components of frequency signal and their oscillators. Only 1..carrier_count, excluding frequency 0 (amplitude),
+    // excluding the ones above. Room for the most carriers, laid out as float[FOURIER_LANE_COUNT][FOURIER_STRIDE(frequency_count)].
+    float fourier_components[FOURIER_LANE_COUNT * FOURIER_STRIDE(CARRIER_COUNT_MAX)];
   };
 };
-static_assert(offsetof(struct decoder, fourier)+sizeof(struct fourier) == offsetof(struct decoder, sincos_components), "Member sincos_components not directly following struct fourier");
+static_assert(offsetof(struct decoder, fourier)+sizeof(struct fourier) == offsetof(struct decoder, fourier_components), "Member fourier_components not directly following struct fourier");
 
 static inline float nsin(float f){
   return sin(f * 2 * M_PI);
@@ -84,63 +195,625 @@ static inline float quad(float x){
   return x*x;
 }
 
-bool fourier_add_sample(struct fourier*const fourier, const float sample){
-  float(*const sincos_components)[2] = (float(*)[2])(fourier+1);
+void fourier_free(struct fourier*const fourier){
+  fft_plan_free(fourier->plan);
+  free(fourier->window);
+  fourier->plan = NULL;
+  fourier->window = NULL;
+}
+
+// (Re)makes the plan and sample buffer of the FFT engine, if the sample_count changed. Returns false if memory is exhausted.
+static bool fourier_fft_prepare(struct fourier*const fourier){
+  if(fourier->plan && fft_plan_sample_count(fourier->plan) == fourier->sample_count)
+    return true;
+  fourier_free(fourier);
+  fourier->plan = fft_plan_create(fourier->sample_count);
+  fourier->window = malloc(sizeof(float) * fourier->sample_count);
+  if(!fourier->plan || !fourier->window){
+    fourier_free(fourier);
+    return false;
+  }
+  return true;
+}
+
+// Transforms a window of sample_count samples. The components of the frequencies are stored to a sine & a cosine lane,
+// laid out like the ones of the other engines.
+static void fourier_fft(const struct fourier*const fourier, const float window[], float* lanes){
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  float(*const components)[n] = (float(*)[n])lanes;
+  const int sample_count = fourier->sample_count;
+  double signal[sample_count];
+  struct fft_complex spectrum[sample_count/2+1];
+  for(int t=0; t<sample_count; t++)
+    signal[t] = window[t];
+  fft_forward(fourier->plan, signal, spectrum);
+  // Frequency f has f+1 cycles per window, that's bin f+1. Windows too short for it only hold half of the bins,
+  // the ones above are the mirror image of those below, which is what the other engines alias it to too.
+  const float scale = 25.f / sample_count;
+  for(int f=0; f<fourier->frequency_count; f++){
+    int bin = (f+1) % sample_count;
+    float sign = -1;
+    if(bin > sample_count/2){
+      bin = sample_count - bin;
+      sign = 1;
+    }
+    components[FOURIER_SIN][f] = sign * spectrum[bin].im * scale;
+    components[FOURIER_COS][f] = spectrum[bin].re * scale;
+  }
+}
+
+// Sets up the oscillators / filters at the start of a new set of samples
+static void fourier_start(struct fourier*const fourier){
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  float(*const components)[n] = (float(*)[n])(fourier+1);
+  if(fourier->engine == FOURIER_FFT){
+    if(fourier_fft_prepare(fourier))
+      return;
+    fourier->engine = FOURIER_DFT; // Slower, but it does the same
+  }
+  if(fourier->rotation_sample_count != fourier->sample_count){
+    for(int f=0; f<n; f++){
+      float i = (float)(f+1) / fourier->sample_count;
+      components[FOURIER_ROT_SIN][f] = nsin(i);
+      components[FOURIER_ROT_COS][f] = ncos(i);
+      fourier->goertzel[GOERTZEL_COS2][f] = 2 * cos(2 * M_PI * (f+1) / fourier->sample_count);
+    }
+    fourier->rotation_sample_count = fourier->sample_count;
+  }
+  if(fourier->engine == FOURIER_GOERTZEL){
+    memset(fourier->goertzel[GOERTZEL_STATE_1], 0, sizeof(double) * n);
+    memset(fourier->goertzel[GOERTZEL_STATE_2], 0, sizeof(double) * n);
+    return;
+  }
+  // The oscillator amplitude includes the normalization of the components
+  const float scale = 25.f / fourier->sample_count;
+  for(int f=0; f<n; f++){
+    components[FOURIER_STATE_1][f] = 0;
+    components[FOURIER_STATE_2][f] = scale;
+  }
+}
+
+static void dft_add_sample(struct fourier*const fourier, const float sample){
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  float(*const components)[n] = (float(*)[n])(fourier+1);
   for(int f=0; f<fourier->frequency_count; f++){
-    float i = (float)((f+1)*fourier->i) / fourier->sample_count;
-    sincos_components[f][0] += nsin(i) * sample * 25 / fourier->sample_count;
-    sincos_components[f][1] += ncos(i) * sample * 25 / fourier->sample_count;
+    const float s = components[FOURIER_STATE_1][f];
+    const float c = components[FOURIER_STATE_2][f];
+    components[FOURIER_SIN][f] += s * sample;
+    components[FOURIER_COS][f] += c * sample;
+    components[FOURIER_STATE_1][f] = s * components[FOURIER_ROT_COS][f] + c * components[FOURIER_ROT_SIN][f];
+    components[FOURIER_STATE_2][f] = c * components[FOURIER_ROT_COS][f] - s * components[FOURIER_ROT_SIN][f];
   }
-  return ++fourier->i >= fourier->sample_count;
+}
+
+static void goertzel_add_sample(struct fourier*const fourier, const float sample){
+  double(*const goertzel)[FOURIER_STRIDE(CARRIER_COUNT_MAX)] = fourier->goertzel;
+  for(int f=0; f<fourier->frequency_count; f++){
+    const double s = sample + goertzel[GOERTZEL_COS2][f] * goertzel[GOERTZEL_STATE_1][f] - goertzel[GOERTZEL_STATE_2][f];
+    goertzel[GOERTZEL_STATE_2][f] = goertzel[GOERTZEL_STATE_1][f];
+    goertzel[GOERTZEL_STATE_1][f] = s;
+  }
+}
+
+#ifdef FOURIER_AVX
+// The lanes are laid out and padded so that 8 frequencies at a time can be updated in one go.
+// No FMA is used, the results are exactly the same as those of the scalar kernels.
+
+__attribute__((target("avx")))
+static void dft_add_sample_avx(struct fourier*const fourier, const float sample){
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  float(*const components)[n] = (float(*)[n])(fourier+1);
+  const __m256 x = _mm256_set1_ps(sample);
+  for(int f=0; f<n; f+=8){
+    const __m256 s = _mm256_loadu_ps(&components[FOURIER_STATE_1][f]);
+    const __m256 c = _mm256_loadu_ps(&components[FOURIER_STATE_2][f]);
+    const __m256 rs = _mm256_loadu_ps(&components[FOURIER_ROT_SIN][f]);
+    const __m256 rc = _mm256_loadu_ps(&components[FOURIER_ROT_COS][f]);
+    _mm256_storeu_ps(&components[FOURIER_SIN][f], _mm256_add_ps(_mm256_loadu_ps(&components[FOURIER_SIN][f]), _mm256_mul_ps(s, x)));
+    _mm256_storeu_ps(&components[FOURIER_COS][f], _mm256_add_ps(_mm256_loadu_ps(&components[FOURIER_COS][f]), _mm256_mul_ps(c, x)));
+    _mm256_storeu_ps(&components[FOURIER_STATE_1][f], _mm256_add_ps(_mm256_mul_ps(s, rc), _mm256_mul_ps(c, rs)));
+    _mm256_storeu_ps(&components[FOURIER_STATE_2][f], _mm256_sub_ps(_mm256_mul_ps(c, rc), _mm256_mul_ps(s, rs)));
+  }
+}
+
+// The goertzel filters are doubles, 4 frequencies at a time
+__attribute__((target("avx")))
+static void goertzel_add_sample_avx(struct fourier*const fourier, const float sample){
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  double(*const goertzel)[FOURIER_STRIDE(CARRIER_COUNT_MAX)] = fourier->goertzel;
+  const __m256d x = _mm256_set1_pd(sample);
+  for(int f=0; f<n; f+=4){
+    const __m256d s1 = _mm256_loadu_pd(&goertzel[GOERTZEL_STATE_1][f]);
+    const __m256d s2 = _mm256_loadu_pd(&goertzel[GOERTZEL_STATE_2][f]);
+    const __m256d c2 = _mm256_loadu_pd(&goertzel[GOERTZEL_COS2][f]);
+    _mm256_storeu_pd(&goertzel[GOERTZEL_STATE_2][f], s1);
+    _mm256_storeu_pd(&goertzel[GOERTZEL_STATE_1][f], _mm256_sub_pd(_mm256_add_pd(x, _mm256_mul_pd(c2, s1)), s2));
+  }
+}
+#endif
+
+// After all samples, the goertzel filter state gives us the same components the DFT would have
+static void goertzel_finish(struct fourier*const fourier){
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  float(*const components)[n] = (float(*)[n])(fourier+1);
+  const double(*const goertzel)[FOURIER_STRIDE(CARRIER_COUNT_MAX)] = (const double(*)[FOURIER_STRIDE(CARRIER_COUNT_MAX)])fourier->goertzel;
+  const double scale = 25. / fourier->sample_count;
+  for(int f=0; f<n; f++){
+    const double s1 = goertzel[GOERTZEL_STATE_1][f];
+    components[FOURIER_SIN][f] = -components[FOURIER_ROT_SIN][f] * s1 * scale;
+    components[FOURIER_COS][f] = (goertzel[GOERTZEL_COS2][f] / 2 * s1 - goertzel[GOERTZEL_STATE_2][f]) * scale;
+  }
+}
+
+// Kernels used by fourier_add_sample & fourier_batch_correlate, fourier_select_kernels picks the best ones the CPU supports
+static void (*g_dft_add_sample)(struct fourier*, float) = dft_add_sample;
+static void (*g_goertzel_add_sample)(struct fourier*, float) = goertzel_add_sample;
+
+
+bool fourier_add_sample(struct fourier*const fourier, const float sample){
+  if(!fourier->i)
+    fourier_start(fourier);
+  switch(fourier->engine){
+    case FOURIER_DFT: g_dft_add_sample(fourier, sample); break;
+    case FOURIER_GOERTZEL: g_goertzel_add_sample(fourier, sample); break;
+    case FOURIER_FFT: fourier->window[fourier->i] = sample; break;
+  }
+  if(++fourier->i < fourier->sample_count)
+    return false;
+  if(fourier->engine == FOURIER_GOERTZEL)
+    goertzel_finish(fourier);
+  if(fourier->engine == FOURIER_FFT)
+    fourier_fft(fourier, fourier->window, (float*)(fourier+1));
+  return true;
 }
 
 // Note: returned frequency is still squared here
 void fourier_to_frequency(struct fourier*const fourier, float fph[]){
-  float(*const sincos_components)[2] = (float(*)[2])(fourier+1);
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  float(*const components)[n] = (float(*)[n])(fourier+1);
   for(int f=0; f<fourier->frequency_count; f++)
-    fph[f] = quad(sincos_components[f][0]) + quad(sincos_components[f][1]);
+    fph[f] = quad(components[FOURIER_SIN][f]) + quad(components[FOURIER_COS][f]);
 }
 
 void fourier_reset(struct fourier*const fourier){
-  float(*const sincos_components)[2] = (float(*)[2])(fourier+1);
-  memset(sincos_components, 0, sizeof(*sincos_components)*fourier->frequency_count);
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  float(*const components)[n] = (float(*)[n])(fourier+1);
+  memset(components[FOURIER_SIN], 0, sizeof(*components));
+  memset(components[FOURIER_COS], 0, sizeof(*components));
   fourier->i = 0;
 }
 
+// The lanes are laid out for the number of frequencies, so this starts over with a new set of samples.
+// There has to be room for the lanes of that many frequencies after the struct.
+void fourier_set_frequency_count(struct fourier*const fourier, int frequency_count){
+  if(fourier->frequency_count == frequency_count)
+    return;
+  fourier->frequency_count = frequency_count;
+  memset(fourier+1, 0, sizeof(float) * FOURIER_LANE_COUNT * FOURIER_STRIDE(frequency_count));
+  fourier->rotation_sample_count = 0; // The rotations need to be recomputed
+  fourier->i = 0;
+}
+
+// The phase of frequency f, in cycles
+static inline float fourier_phase(const struct fourier*const fourier, int f){
+  const int n = FOURIER_STRIDE(fourier->frequency_count);
+  const float(*const components)[n] = (const float(*)[n])(fourier+1);
+  return sincos_to_phase(components[FOURIER_SIN][f], components[FOURIER_COS][f]);
+}
+
+/////////////////////////////////////////////
+// Correlation of whole windows of samples //
+/////////////////////////////////////////////
+
+// Once the symbol length is known, the windows of many symbols can be gathered and correlated
+// with a precomputed sine / cosine basis matrix in one go, instead of adding one sample at a time.
+// The results are the same components fourier_add_sample would have produced.
+
+void fourier_batch_free(struct fourier_batch*const batch){
+  free(batch->basis);
+  free(batch->windows);
+  free(batch->results);
+  *batch = (struct fourier_batch){0};
+}
+
+// (Re)computes the basis matrix, if the sample_count changed. Returns false if memory is exhausted.
+bool fourier_batch_prepare(struct fourier_batch*const batch, const struct fourier*const fourier){
+  const int n = fourier->sample_count;
+  const int columns = 2 * FOURIER_STRIDE(fourier->frequency_count);
+  if(batch->basis && batch->sample_count == n && batch->columns == columns)
+    return true;
+  fourier_batch_free(batch);
+  batch->basis = malloc(sizeof(float) * n * columns);
+  batch->windows = malloc(sizeof(float) * FOURIER_BATCH_WINDOWS * n);
+  batch->results = malloc(sizeof(float) * FOURIER_BATCH_WINDOWS * columns);
+  if(!batch->basis || !batch->windows || !batch->results){
+    fourier_batch_free(batch);
+    return false;
+  }
+  batch->sample_count = n;
+  batch->columns = columns;
+  float(*const basis)[2][columns/2] = (float(*)[2][columns/2])batch->basis;
+  const float scale = 25.f / n;
+  for(int t=0; t<n; t++){
+    for(int f=0; f<columns/2; f++){
+      float i = (float)((f+1)*t % n) / n;
+      basis[t][FOURIER_SIN][f] = nsin(i) * scale;
+      basis[t][FOURIER_COS][f] = ncos(i) * scale;
+    }
+  }
+  return true;
+}
+
+static void correlate_windows(int window_count, int sample_count, int columns, const float*restrict basis, const float*restrict windows, float*restrict results){
+  for(int w=0; w<window_count; w++){
+    float*restrict result = results + w * columns;
+    for(int j=0; j<columns; j++)
+      result[j] = 0;
+    for(int t=0; t<sample_count; t++){
+      const float x = windows[w * sample_count + t];
+      for(int j=0; j<columns; j++)
+        result[j] += x * basis[t * columns + j];
+    }
+  }
+}
+
+#ifdef FOURIER_AVX
+__attribute__((target("avx")))
+static void correlate_windows_avx(int window_count, int sample_count, int columns, const float*restrict basis, const float*restrict windows, float*restrict results){
+  for(int w=0; w<window_count; w++){
+    const float* window = windows + w * sample_count;
+    for(int j=0; j<columns; j+=8){
+      __m256 result = _mm256_setzero_ps();
+      for(int t=0; t<sample_count; t++)
+        result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_set1_ps(window[t]), _mm256_loadu_ps(basis + t * columns + j)));
+      _mm256_storeu_ps(results + w * columns + j, result);
+    }
+  }
+}
+#endif
+
+static void (*g_correlate_windows)(int, int, int, const float*restrict, const float*restrict, float*restrict) = correlate_windows;
+
+// Correlates the first window_count windows in batch->windows, results are float[window_count][2][stride].
+// The FFT engine transforms each window instead.
+void fourier_batch_correlate(struct fourier_batch*const batch, struct fourier*const fourier, int window_count){
+  if(fourier->engine == FOURIER_FFT && fourier_fft_prepare(fourier)){
+    for(int w=0; w<window_count; w++)
+      fourier_fft(fourier, batch->windows + w * batch->sample_count, batch->results + w * batch->columns);
+    return;
+  }
+  g_correlate_windows(window_count, batch->sample_count, batch->columns, batch->basis, batch->windows, batch->results);
+}
+
+void fourier_select_kernels(bool allow_simd){
+  g_dft_add_sample = dft_add_sample;
+  g_goertzel_add_sample = goertzel_add_sample;
+  g_correlate_windows = correlate_windows;
+  if(!allow_simd)
+    return;
+#ifdef FOURIER_AVX
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx")){
+    g_dft_add_sample = dft_add_sample_avx;
+    g_goertzel_add_sample = goertzel_add_sample_avx;
+    g_correlate_windows = correlate_windows_avx;
+  }
+#endif
+}
+
 enum {
   DECODER_RET_EOF = -1,
   DECODER_RET_NO_DATA = -2,
   DECODER_RET_ERROR = -3,
+  DECODER_RET_RESYNC = -4, // The transmission restarts with a new preamble
 };
 
-int decoder_decode_byte(struct decoder* decoder, float sample){
-  if(fourier_add_sample(&decoder->fourier, sample)){
-    float frequency[decoder->fourier.frequency_count];
-    fourier_to_frequency(&decoder->fourier, frequency);
-    unsigned byte = 0;
-    for(int f=0; f<decoder->fourier.frequency_count; f++){
-      if(frequency[f] > 0.5*0.5)
-        byte |= 1u<<(BIT_COUNT-f-1);
-      // fprintf(stderr,"%.2f ", /*sqrt*/(frequency[f]));
+// The amplitude of data carrier b, relative to the one of the sync signal
+static inline float level_ratio(const struct decoder* decoder, const float frequency[], int b){
+  return sqrt(frequency[decoder->profile.carrier_count-1-b] / frequency[0]);
+}
+
+static void decoder_train_levels(struct decoder* decoder, const float frequency[]){
+  const unsigned level_count = 1u << decoder->profile.bits_per_carrier;
+  const int data_carriers = decoder->profile.carrier_count - 1;
+  const unsigned l = decoder->train_level++;
+  for(int b=0; b<data_carriers; b++)
+    decoder->level_threshold[b][l] = level_ratio(decoder, frequency, b);
+  if(decoder->train_level < level_count)
+    return;
+  // Half way between neighbouring levels
+  for(int b=0; b<data_carriers; b++)
+    for(unsigned l=0; l<level_count-1; l++)
+      decoder->level_threshold[b][l] = (decoder->level_threshold[b][l] + decoder->level_threshold[b][l+1]) / 2;
+  decoder->state = DECODER_DETECT_CALIBRATE;
+}
+
+// Wraps a phase difference into -0.5 to 0.5 cycles
+static inline float wrap_phase(float x){
+  return x - floorf(x + 0.5f);
+}
+
+static void decoder_phase_reference(struct decoder* decoder){
+  for(int f=0; f<decoder->profile.carrier_count; f++)
+    decoder->carrier_phase[f] = fourier_phase(&decoder->fourier, f);
+}
+
+// The level of each data carrier is by how much its phase advanced since the last symbol.
+// Where the symbol was cut out of the signal moved too, which shifts each frequency by a multiple of how much the
+// sync signal was shifted. Noise in that gets multiplied too, so lower frequencies, which are less sensitive to it,
+// are decided first, and each refines the timing for the next by a least squares fit. Louder frequencies are less
+// affected by noise, so they are weighted by their power.
+// offset is how far each level is from the measured phase shift, in levels.
+static void decoder_phase_levels(struct decoder* decoder, const float frequency[], unsigned level[CARRIER_COUNT_MAX-1], float offset[CARRIER_COUNT_MAX-1]){
+  const unsigned level_count = 1u << decoder->profile.bits_per_carrier;
+  const int carrier_count = decoder->profile.carrier_count;
+  float shift[CARRIER_COUNT_MAX];
+  for(int f=0; f<carrier_count; f++){
+    const float phase = fourier_phase(&decoder->fourier, f);
+    shift[f] = wrap_phase(phase - decoder->carrier_phase[f]);
+    decoder->carrier_phase[f] = phase;
+  }
+  float timing = shift[0]; // In cycles of the sync signal
+  float moment = frequency[0] * shift[0];
+  float weight = frequency[0];
+  for(int f=1; f<carrier_count; f++){
+    const float data_shift = shift[f] - (f+1) * timing;
+    const long rounded = lroundf(data_shift * level_count);
+    const unsigned l = (unsigned)rounded & (level_count - 1);
+    level[carrier_count-1-f] = l;
+    offset[carrier_count-1-f] = data_shift * level_count - rounded;
+    moment += frequency[f] * (f+1) * ((f+1) * timing + wrap_phase(data_shift - (float)l / level_count));
+    weight += frequency[f] * (f+1) * (f+1);
+    timing = moment / weight;
+  }
+}
+
+static unsigned amplitude_level(const struct decoder* decoder, const float frequency[], int b){
+  const unsigned max_level = (1u << decoder->profile.bits_per_carrier) - 1;
+  const float ratio = level_ratio(decoder, frequency, b);
+  unsigned level = 0;
+  while(level < max_level && ratio > decoder->level_threshold[b][level])
+    level++;
+  return level;
+}
+
+// Whether the data symbols are on / off keyed bytes, like the control symbols
+static inline bool decoder_plain_bytes(const struct decoder* decoder){
+  const struct modem_profile*const profile = &decoder->profile;
+  return profile->modulation == MODULATION_AMPLITUDE && profile->bits_per_carrier == 1 && profile->carrier_count == BIT_COUNT;
+}
+
+enum {
+  NOISE_AVERAGING = 16, // Symbols
+};
+
+// Turns how far each bit of the last data symbol was from flipping into its soft decision, see conv_soft.
+// With Gaussian noise of variance noise around levels a distance of level from where the bit flips, the log-likelihood
+// ratio of a bit at distance from there is 2 * level * distance / noise, level_distance holds level * distance of each
+// bit. deviation is the sum of the squares of how far the carriers of the symbol were from their levels, which the
+// noise is averaged from.
+static void decoder_soft_output(struct decoder* decoder, const float level_distance[], int bit_count, float deviation, int carrier_count){
+  const float variance = deviation / carrier_count;
+  decoder->noise = decoder->noise ? decoder->noise + (variance - decoder->noise) / NOISE_AVERAGING : variance;
+  // Even a perfect signal isn't infinitely sure, this only stops the ratios from overflowing
+  const float scale = 2 * CONV_SOFT_UNIT / (decoder->noise > 1e-4f ? decoder->noise : 1e-4f);
+  const unsigned char*const symbol = decoder->symbol;
+  conv_soft*const soft = decoder->symbol_soft;
+  for(int j=0; j<bit_count; j++){
+    const float product = level_distance[j] * scale;
+    const int sign = (symbol[j/8] >> j%8 & 1) * 2 - 1; // Rather than a branch, which the data would make unpredictable
+    soft[j] = sign * (product < 127 ? product : 127);
+  }
+}
+
+// Whether the payload has error correction, which uses soft decisions
+static inline bool decoder_soft_wanted(const struct decoder* decoder){
+  return decoder->profile.convolutional || decoder->profile.fec_depth;
+}
+
+// Works out where each bit flips around each level, once the profile is known. For phase shifts, how many levels on
+// from the level the boundary is, they wrap around. For amplitudes, the index of the threshold, -1 if there is none.
+static void decoder_soft_boundaries(struct decoder* decoder){
+  const int bits_per_carrier = decoder->profile.bits_per_carrier;
+  const unsigned level_count = 1u << bits_per_carrier;
+  const unsigned mask = level_count - 1;
+  const bool phase_modulation = decoder->profile.modulation == MODULATION_PHASE;
+  for(unsigned l=0; l<level_count; l++){
+    for(int i=0; i<bits_per_carrier; i++){
+      int8_t*const above = &decoder->flip_above[l][i];
+      int8_t*const below = &decoder->flip_below[l][i];
+      *above = *below = phase_modulation ? (int)level_count : -1;
+      if(phase_modulation){
+        for(int k=level_count/2-1; k>=0; k--){
+          if((modem_level_to_bits((l + k) & mask) ^ modem_level_to_bits((l + k + 1) & mask)) >> i & 1)
+            *above = k;
+          if((modem_level_to_bits((l - k) & mask) ^ modem_level_to_bits((l - k - 1) & mask)) >> i & 1)
+            *below = k;
+        }
+      }else{
+        for(unsigned t=0; t+1<level_count; t++){
+          if(!((modem_level_to_bits(t) ^ modem_level_to_bits(t + 1)) >> i & 1))
+            continue;
+          if(t >= l && *above < 0)
+            *above = t;
+          if(t < l)
+            *below = t;
+        }
+      }
     }
-    // fprintf(stderr,"\n");
-    // fprintf(stderr,"f %X\n", byte);
-    if(byte & 0x100u){
-      // We use the lowest frequency for adjustments. One full wavelength includes all the samples.
-      const float phase = sincos_to_phase(decoder->sincos_components[0][0], decoder->sincos_components[0][1]);
-      decoder->phase = round(phase * decoder->fourier.sample_count);
-      // fprintf(stderr,"> %f %d\n", phase, decoder->phase);
+  }
+}
+
+// How far the measurement of each bit of the levels is from where the bit would change, in halves of the distance
+// between neighbouring levels, so 1 in the middle of one, times that of the level. A weaker carrier is thrown off by
+// noise more easily when it comes to phase shifts, so those are weighted by its amplitude. offset is that of
+// decoder_phase_levels. Each level boundary flips one bit, so the nearest one is that of the surest bit.
+static void decoder_soft_decisions(struct decoder* decoder, const float frequency[], const unsigned level[CARRIER_COUNT_MAX-1], const float offset[CARRIER_COUNT_MAX-1]){
+  const int bits_per_carrier = decoder->profile.bits_per_carrier;
+  const int data_carriers = decoder->profile.carrier_count - 1;
+  const int groups = data_carriers / 8;
+  const bool phase_modulation = decoder->profile.modulation == MODULATION_PHASE;
+  int8_t (*const above)[BITS_PER_CARRIER_MAX] = decoder->flip_above;
+  int8_t (*const below)[BITS_PER_CARRIER_MAX] = decoder->flip_below;
+  float level_distance[SYMBOL_BYTES_MAX * 8];
+  float deviation = 0;
+  for(int b=0; b<data_carriers; b++){
+    const unsigned l = level[b];
+    const float ratio = level_ratio(decoder, frequency, b);
+    const float*const threshold = decoder->level_threshold[b];
+    const float weight = phase_modulation ? ratio : 1;
+    float nearest = INFINITY;
+    for(int i=0; i<bits_per_carrier; i++){
+      float distance;
+      if(phase_modulation){
+        const float up = above[l][i] + 0.5f - offset[b], down = below[l][i] + 0.5f + offset[b];
+        distance = 2 * ratio * (up < down ? up : down);
+      }else{
+        // Level 0 is off, so the first threshold is half the distance between levels
+        const float up = above[l][i] >= 0 ? fabsf(threshold[above[l][i]] - ratio) : INFINITY;
+        const float down = below[l][i] >= 0 ? fabsf(ratio - threshold[below[l][i]]) : INFINITY;
+        distance = (up < down ? up : down) / threshold[0];
+      }
+      nearest = distance < nearest ? distance : nearest;
+      level_distance[(i*groups + b/8)*8 + b%8] = weight * distance;
+    }
+    deviation += (weight - nearest) * (weight - nearest);
+  }
+  decoder_soft_output(decoder, level_distance, bits_per_carrier * data_carriers, deviation, data_carriers);
+}
+
+// Turns the data carriers into the payload bytes of the symbol, see modem_symbol_bytes
+static void decoder_demodulate(struct decoder* decoder, const float frequency[], unsigned byte){
+  const int bits_per_carrier = decoder->profile.bits_per_carrier;
+  const int data_carriers = decoder->profile.carrier_count - 1;
+  const int groups = data_carriers / 8;
+  const int symbol_bytes = modem_symbol_bytes(&decoder->profile);
+  const bool phase_modulation = decoder->profile.modulation == MODULATION_PHASE;
+  if(phase_modulation && decoder->phase_reference){
+    decoder_phase_reference(decoder);
+    decoder->phase_reference = false;
+    decoder->symbol_size = 0;
+    return;
+  }
+  decoder->symbol_size = decoder->symbol_limit;
+  decoder->symbol_limit = symbol_bytes;
+  if(decoder_plain_bytes(decoder)){
+    decoder->symbol[0] = byte;
+    if(!decoder_soft_wanted(decoder))
+      return;
+    // On / off keying, like the control symbols, the levels are 0 and 1
+    float level_distance[8];
+    float deviation = 0;
+    for(int i=0; i<8; i++){
+      level_distance[i] = fabsf(sqrtf(frequency[BIT_COUNT-1-i]) - 0.5f) * 2;
+      deviation += (1 - level_distance[i]) * (1 - level_distance[i]);
+    }
+    decoder_soft_output(decoder, level_distance, 8, deviation, 8);
+    return;
+  }
+  unsigned level[CARRIER_COUNT_MAX-1];
+  float offset[CARRIER_COUNT_MAX-1] = {0};
+  if(phase_modulation){
+    decoder_phase_levels(decoder, frequency, level, offset);
+  }else{
+    for(int b=0; b<data_carriers; b++)
+      level[b] = amplitude_level(decoder, frequency, b);
+  }
+  memset(decoder->symbol, 0, symbol_bytes);
+  for(int b=0; b<data_carriers; b++){
+    const unsigned bits = modem_level_to_bits(level[b]);
+    for(int i=0; i<bits_per_carrier; i++)
+      decoder->symbol[i*groups + b/8] |= (bits >> i & 1) << b%8;
+  }
+  if(decoder_soft_wanted(decoder))
+    decoder_soft_decisions(decoder, frequency, level, offset);
+}
+
+// Data symbol windows start this many samples into the end of the cyclic prefix, rather than right after it.
+// That way, neither a symbol arriving a bit early, nor one arriving a bit late spills into the window.
+// Starting within the prefix, the window holds the same samples, only rotated, which shifts the phase of the
+// sync signal by just as many samples. The timing phase is relative to that.
+static inline int decoder_guard_early(const struct decoder*const decoder){
+  return decoder->guard / 2;
+}
+
+// Turns the completed fourier components of a symbol into a byte, and determines the timing phase.
+// Data symbols are demodulated into decoder->symbol, the byte is what on / off keying would make of it.
+static int decoder_finish_symbol(struct decoder* decoder){
+  float frequency[decoder->fourier.frequency_count];
+  fourier_to_frequency(&decoder->fourier, frequency);
+  unsigned byte = 0;
+  for(int f=0; f<BIT_COUNT; f++){
+    if(frequency[f] > 0.5*0.5)
+      byte |= 1u<<(BIT_COUNT-f-1);
+    // fprintf(stderr,"%.2f ", /*sqrt*/(frequency[f]));
+  }
+  // fprintf(stderr,"\n");
+  // fprintf(stderr,"f %X\n", byte);
+  if(byte & 0x100u){
+    // We use the lowest frequency for adjustments. One full wavelength includes all the samples.
+    const float phase = fourier_phase(&decoder->fourier, 0);
+    decoder->phase = round(phase * decoder->fourier.sample_count);
+    // fprintf(stderr,"> %f %d\n", phase, decoder->phase);
+    if(decoder->state == DECODER_DECODE_DATA)
+      decoder->phase += decoder_guard_early(decoder);
+  }else{
+    decoder->phase = 0;
+  }
+  if(decoder->state == DECODER_DECODE_DATA)
+    decoder->guard_left = decoder->guard;
+  int ret = byte & 0xFF;
+  if(byte == 0){
+    ret = DECODER_RET_EOF;
+  }else if(byte == RESYNC_SIGNAL){
+    ret = DECODER_RET_RESYNC;
+  }else if(decoder->state == DECODER_TRAIN_LEVELS){
+    decoder_train_levels(decoder, frequency);
+  }else if(decoder->state == DECODER_DECODE_DATA){
+    const unsigned end = byte & ~END_SIGNAL;
+    if(!decoder_plain_bytes(decoder) && (byte & (SYNC_SIGNAL | END_SIGNAL)) == END_SIGNAL && end && end < modem_symbol_bytes(&decoder->profile)){
+      decoder->symbol_limit = end;
+      ret = DECODER_RET_NO_DATA;
     }else{
-      decoder->phase = 0;
+      decoder_demodulate(decoder, frequency, byte);
     }
-    fourier_reset(&decoder->fourier);
-    if(byte == 0)
-      return DECODER_RET_EOF;
-    return byte & 0xFF;
   }
+  fourier_reset(&decoder->fourier);
+  return ret;
+}
+
+int decoder_decode_byte(struct decoder* decoder, float sample){
+  if(fourier_add_sample(&decoder->fourier, sample))
+    return decoder_finish_symbol(decoder);
   return DECODER_RET_NO_DATA;
 }
 
+// Once a symbol is complete, makes up for it having been late: the cyclic prefix of the next one started early,
+// so fewer of its samples are left to skip. Without one, the last sample is used for the next symbol too.
+// Returns whether that's the case.
+static bool decoder_catch_up(struct decoder*const decoder){
+  if(decoder->phase > 0 && decoder->guard_left){
+    const int late = decoder->phase < decoder->guard_left ? decoder->phase : decoder->guard_left;
+    decoder->guard_left -= late;
+    decoder->phase -= late;
+  }
+  return decoder->phase > 0;
+}
+
+// If the timing was off in the same direction for the last few symbols, the symbol length is adjusted,
+// though never below what the carriers need, or above the longest symbols
+static void decoder_track_timing(struct decoder*const decoder){
+  if(decoder->phase && decoder->phase2 && decoder->phase3 && (decoder->phase < 0) == (decoder->phase2 < 0) && (decoder->phase2 < 0) == (decoder->phase3 < 0)){
+    const int min = modem_sample_count_min(decoder->profile.carrier_count);
+    const int sample_count = decoder->fourier.sample_count - (decoder->phase + decoder->phase2 + decoder->phase3) / 3;
+    decoder->fourier.sample_count = sample_count < min ? min : sample_count > SAMPLE_COUNT_MAX ? SAMPLE_COUNT_MAX : sample_count;
+    decoder->phase2 = 0;
+  }else{
+    decoder->phase3 = decoder->phase2;
+    decoder->phase2 = decoder->phase;
+  }
+}
+
 enum { TIMING_SIGNAL_THRESHOLD = 64 };
 
 static inline void decoder_update_magnitude(struct decoder*const decoder, const uint16_t sample){
@@ -150,20 +823,86 @@ static inline void decoder_update_magnitude(struct decoder*const decoder, const
     decoder->signal_min = sample;
 }
 
+// Starts over with the detection of the preamble.
+// The end of the resync symbol is skipped, so that the baseline is only taken from the silence after it.
+static void decoder_resync(struct decoder*const decoder){
+  decoder->state = DECODER_INIT;
+  decoder->resynced = true;
+  decoder->phase = -decoder->fourier.sample_count / 2;
+}
+
+// The symbol length was only measured roughly so far. If the sample rate of the recording is known,
+// the exact one follows from the profile, even if the recording was resampled. A rate that makes symbols too short
+// for the carriers, or longer than any, can't be the one of the recording, the profile's own is used then.
+static void decoder_apply_profile(struct decoder*const decoder){
+  const struct modem_profile*const profile = &decoder->profile;
+  decoder->guard = profile->guard_count;
+  if(decoder->sample_rate){
+    const double ratio = (double)decoder->sample_rate / profile->sample_rate;
+    const long sample_count = lround(profile->sample_count * ratio);
+    if(sample_count >= modem_sample_count_min(profile->carrier_count) && sample_count <= SAMPLE_COUNT_MAX){
+      decoder->fourier.sample_count = sample_count;
+      decoder->guard = lround(profile->guard_count * ratio);
+    }else{
+      fprintf(stderr, "profile: a sample rate of %u Hz leaves %ld samples per symbol, using %u Hz\n", decoder->sample_rate, sample_count, profile->sample_rate);
+      decoder->fourier.sample_count = profile->sample_count;
+    }
+  }
+  fourier_set_frequency_count(&decoder->fourier, profile->carrier_count);
+}
+
+static void decoder_read_profile(struct decoder*const decoder, unsigned char byte){
+  decoder->profile_record[decoder->profile_size++] = byte;
+  if(modem_profile_remaining(decoder->profile_record, decoder->profile_size))
+    return;
+  const char* error = modem_profile_decode(&decoder->profile, decoder->profile_record, decoder->profile_size);
+  if(error){
+    // Carry on like with a stream that has no profile, that's still the best guess
+    fprintf(stderr, "profile: %s, using the defaults\n", error);
+    decoder->profile = modem_profile_default;
+  }else{
+    decoder_apply_profile(decoder);
+  }
+  decoder->state = DECODER_DETECT_CALIBRATE;
+  if(decoder->profile.modulation == MODULATION_AMPLITUDE && !decoder_plain_bytes(decoder)){
+    decoder->state = DECODER_TRAIN_LEVELS;
+    decoder->train_level = 0;
+  }
+}
+
+// How long before the sample the signal crossed the middle, in samples, interpolated between it and the previous one
+static inline float decoder_crossing(const struct decoder*const decoder, const uint16_t sample){
+  const int middle = (decoder->signal_max + decoder->signal_min) / 2;
+  return (float)(sample - middle) / (sample - decoder->last_sample);
+}
+
+static inline float decoder_normalize(const struct decoder*const decoder, const uint16_t sample){
+  float fsample = (float)(sample - decoder->signal_min) / (decoder->signal_max - decoder->signal_min);
+  if(!decoder->polarity)
+    fsample = 1.f-fsample;
+  return fsample;
+}
+
+// Returns how many bytes of payload decoder->symbol holds once a data symbol is complete, a DECODER_RET_* otherwise
 int decoder_decode(struct decoder*const decoder, const uint16_t sample){
   // if(decoder->state != DECODER_EOF)
   //   fprintf(stderr,"%s: %c %u < %u < %u: %u\n", decoder_state_str[decoder->state], decoder->polarity?'+':'-', decoder->signal_min, decoder->baseline, decoder->signal_max, sample);
-  float fsample;
-  if(decoder->state >= DECODER_DETECT_CALIBRATE){
-    fsample = (float)(sample - decoder->signal_min) / (decoder->signal_max - decoder->signal_min);
-    if(!decoder->polarity)
-      fsample = 1.f-fsample;
-  }
+  float fsample = 0;
+  if(decoder->state >= DECODER_DETECT_CALIBRATE)
+    fsample = decoder_normalize(decoder, sample);
   switch(decoder->state){
     case DECODER_INIT: {
+      if(decoder->phase < 0){
+        decoder->phase++;
+        break;
+      }
       decoder->baseline = sample;
       decoder->state = DECODER_DETECT_POLARITY;
       decoder->fourier.sample_count = 0;
+      decoder->profile = modem_profile_default; // Unless the preamble has a profile record
+      decoder->guard = 0;
+      decoder->guard_left = 0;
+      fourier_set_frequency_count(&decoder->fourier, BIT_COUNT);
     } break;
     case DECODER_DETECT_POLARITY: {
       int diff = sample - decoder->baseline;
@@ -174,7 +913,9 @@ int decoder_decode(struct decoder*const decoder, const uint16_t sample){
         decoder->signal_max = decoder->baseline;
         decoder->signal_min = decoder->baseline;
       }else{
-        decoder->baseline = (int)decoder->baseline + diff / 8;
+        // Follow drift slowly, but not the start of a wave, or a slow one never stands out
+        if(diff < TIMING_SIGNAL_THRESHOLD / 8 && diff > -TIMING_SIGNAL_THRESHOLD / 8)
+          decoder->baseline = (int)decoder->baseline + (diff > 0) - (diff < 0);
         break;
       }
     } /* fallthrough */
@@ -184,22 +925,49 @@ int decoder_decode(struct decoder*const decoder, const uint16_t sample){
       if(diff > decoder->signal_max - decoder->signal_min)
         decoder->state = DECODER_DETECT_WAVE_SECOND_HALF;
       decoder_update_magnitude(decoder, sample);
+      decoder->last_sample = sample;
     } break;
     case DECODER_DETECT_WAVE_SECOND_HALF: {
       decoder->fourier.sample_count++;
       decoder_update_magnitude(decoder, sample);
       //fprintf(stderr,"! %c %u\n", decoder->polarity?'+':'-', (decoder->signal_max + decoder->signal_min) / 2);
       if((sample > (decoder->signal_max + decoder->signal_min) / 2) == decoder->polarity){
-        // Note: sample_count is a very, very rough estimate
-        if(decoder->fourier.sample_count < SAMPLE_COUNT_MIN)
-          decoder->fourier.sample_count = SAMPLE_COUNT_MIN;
-        decoder->state = DECODER_DETECT_CALIBRATE;
-        decoder->phase = 0;
-        decoder->phase2 = 0;
-        decoder->phase3 = 0;
+        // The first wave was only counted from when it got noticed, which is quite a bit late for long symbols.
+        // Now that its level is known, the next one is measured from one crossing of the middle to the next.
+        decoder->state = DECODER_DETECT_PERIOD_FIRST_HALF;
+        decoder->fourier.sample_count = 1;
+        decoder->crossing = decoder_crossing(decoder, sample);
       }
+      decoder->last_sample = sample;
     } break;
-    case DECODER_DETECT_CALIBRATE: {
+    case DECODER_DETECT_PERIOD_FIRST_HALF: {
+      decoder->fourier.sample_count++;
+      // Well below the middle, so that noise around the crossing isn't taken for the next one
+      const int quarter = (decoder->signal_max - decoder->signal_min) / 4;
+      if(decoder->polarity ? sample < decoder->signal_min + quarter : sample > decoder->signal_max - quarter)
+        decoder->state = DECODER_DETECT_PERIOD_SECOND_HALF;
+      decoder->last_sample = sample;
+    } break;
+    case DECODER_DETECT_PERIOD_SECOND_HALF: {
+      if((sample > (decoder->signal_max + decoder->signal_min) / 2) != decoder->polarity){
+        decoder->fourier.sample_count++;
+        decoder->last_sample = sample;
+        break;
+      }
+      // Counted in whole samples, noise could move either crossing by one. Where they fall in between is more exact.
+      decoder->fourier.sample_count = lroundf(decoder->fourier.sample_count + decoder->crossing - decoder_crossing(decoder, sample));
+      // Note: sample_count is still a rough estimate
+      if(decoder->fourier.sample_count < SAMPLE_COUNT_MIN)
+        decoder->fourier.sample_count = SAMPLE_COUNT_MIN;
+      decoder->state = DECODER_DETECT_CALIBRATE;
+      decoder->phase = 0;
+      decoder->phase2 = 0;
+      decoder->phase3 = 0;
+    } break;
+    case DECODER_DETECT_CALIBRATE:
+    case DECODER_READ_PROFILE:
+    case DECODER_TRAIN_LEVELS: {
+      const enum decoder_state state = decoder->state;
       // fprintf(stderr, "> %d\n", decoder->fourier.sample_count);
       // decoder->state = DECODER_EOF;
       if(decoder->phase < 0){
@@ -214,17 +982,30 @@ int decoder_decode(struct decoder*const decoder, const uint16_t sample){
       }
       if(byte >= 0){
         // fprintf(stderr, "!! %d\n", decoder->phase);
-        if(decoder->phase && decoder->phase2 && decoder->phase3 && (decoder->phase < 0) == (decoder->phase2 < 0) && (decoder->phase2 < 0) == (decoder->phase3 < 0)){
-          decoder->fourier.sample_count -= (decoder->phase + decoder->phase2 + decoder->phase3) / 3;
-          decoder->phase2 = 0;
-        }else{
-          decoder->phase3 = decoder->phase2;
-          decoder->phase2 = decoder->phase;
-        }
-        if(byte == '>'){ // start byte
+        decoder_track_timing(decoder);
+        if(state == DECODER_READ_PROFILE){
+          decoder_read_profile(decoder, byte);
+        }else if(state == DECODER_DETECT_CALIBRATE && byte == START_SIGNAL){
           decoder->state = DECODER_DECODE_DATA;
+          decoder->guard_left = decoder->guard - decoder_guard_early(decoder);
+          decoder->symbol_limit = modem_symbol_bytes(&decoder->profile);
+          decoder->phase_reference = true;
+          decoder->noise = 0;
+          decoder_soft_boundaries(decoder);
+          const uint8_t symbol_size = modem_symbol_bytes(&decoder->profile);
+          if(decoder->fec_depth != decoder->profile.fec_depth || decoder->convolutional != decoder->profile.convolutional || decoder->conv_symbol_size != symbol_size){
+            // Never the case within a stream from d2s
+            decoder->fec_depth = decoder->profile.fec_depth;
+            decoder->convolutional = decoder->profile.convolutional;
+            decoder->conv_symbol_size = symbol_size;
+            decoder->fec_size = 0;
+            decoder->conv_size = 0;
+          }
+        }else if(state == DECODER_DETECT_CALIBRATE && byte == PROFILE_SIGNAL){
+          decoder->state = DECODER_READ_PROFILE;
+          decoder->profile_size = 0;
         }
-        if(decoder->phase > 0)
+        if(decoder_catch_up(decoder))
           decoder_decode_byte(decoder, fsample);
       }
     } break;
@@ -233,19 +1014,22 @@ int decoder_decode(struct decoder*const decoder, const uint16_t sample){
         decoder->phase++;
         break;
       }
+      if(decoder->guard_left){
+        decoder->guard_left--;
+        break;
+      }
       int byte = decoder_decode_byte(decoder, fsample);
       if(byte == DECODER_RET_EOF)
         decoder->state = DECODER_EOF;
+      if(byte == DECODER_RET_RESYNC){
+        decoder_resync(decoder);
+        return DECODER_RET_NO_DATA;
+      }
       if(byte >= 0){
-        if(decoder->phase && decoder->phase2 && decoder->phase3 && (decoder->phase < 0) == (decoder->phase2 < 0) && (decoder->phase2 < 0) == (decoder->phase3 < 0)){
-          decoder->fourier.sample_count -= (decoder->phase + decoder->phase2 + decoder->phase3) / 3;
-          decoder->phase2 = 0;
-        }else{
-          decoder->phase3 = decoder->phase2;
-          decoder->phase2 = decoder->phase;
-        }
-        if(decoder->phase > 0)
+        decoder_track_timing(decoder);
+        if(decoder_catch_up(decoder))
           decoder_decode_byte(decoder, fsample);
+        return decoder->symbol_size;
       }
       return byte;
     } break;
@@ -254,20 +1038,700 @@ int decoder_decode(struct decoder*const decoder, const uint16_t sample){
   return DECODER_RET_NO_DATA;
 }
 
+// Appends the payload of the last data symbol to out, and its soft decisions to soft
+static inline void decoder_append_symbol(const struct decoder*const decoder, unsigned char out[], conv_soft soft[], size_t*const n){
+  memcpy(out + *n, decoder->symbol, decoder->symbol_size);
+  if(decoder_soft_wanted(decoder))
+    memcpy(soft + *n * 8, decoder->symbol_soft, decoder->symbol_size * 8);
+  *n += decoder->symbol_size;
+}
+
+// Decodes as many whole data symbols as possible by correlating their windows at once.
+// The windows are assumed to follow each other a cyclic prefix apart. Once a timing correction is needed, that no
+// longer holds, and the remaining results are discarded. The next call starts over from where the next symbol actually starts.
+// Returns the number of samples consumed, the decoded bytes are appended to out, like by decoder_append_symbol.
+static size_t decoder_decode_windows(struct decoder*const decoder, size_t count, const uint16_t samples[count], unsigned char out[], conv_soft soft[], size_t*const n){
+  struct fourier_batch*const batch = &decoder->batch;
+  const int sample_count = decoder->fourier.sample_count;
+  const size_t first = decoder->guard_left; // Where the first window starts
+  const size_t stride = decoder->guard + sample_count;
+  size_t window_count = count >= first + sample_count ? (count - first - sample_count) / stride + 1 : 0;
+  if(window_count > FOURIER_BATCH_WINDOWS)
+    window_count = FOURIER_BATCH_WINDOWS;
+  if(!window_count || !fourier_batch_prepare(batch, &decoder->fourier))
+    return 0;
+  for(size_t w=0; w<window_count; w++)
+    for(int t=0; t<sample_count; t++)
+      batch->windows[w * sample_count + t] = decoder_normalize(decoder, samples[first + w * stride + t]);
+  fourier_batch_correlate(batch, &decoder->fourier, window_count);
+  size_t used = 0;
+  for(size_t w=0; w<window_count; w++){
+    // The sine & cosine lanes follow each other, just like in the results
+    memcpy(decoder->fourier_components, batch->results + w * batch->columns, sizeof(float) * batch->columns);
+    used = first + w * stride + sample_count;
+    int byte = decoder_finish_symbol(decoder);
+    if(byte == DECODER_RET_EOF){
+      decoder->state = DECODER_EOF;
+      break;
+    }
+    if(byte == DECODER_RET_RESYNC){
+      decoder_resync(decoder);
+      break;
+    }
+    if(byte == DECODER_RET_NO_DATA)
+      continue; // An END_SIGNAL
+    decoder_append_symbol(decoder, out, soft, n);
+    decoder_track_timing(decoder);
+    if(decoder->phase || decoder->fourier.sample_count != sample_count){
+      if(decoder_catch_up(decoder))
+        used--; // The last sample is used for the next symbol too
+      break;
+    }
+  }
+  return used;
+}
+
+// Decodes a whole span of samples at once. Symbols are longer than the payload they hold,
+// so out needs room for count + SYMBOL_BYTES_MAX bytes. If the payload has error correction, the soft decisions of their
+// bits, how sure the demodulator is of each, are stored to soft, see conv_soft. Returns the number of bytes stored to out. Stops early once the end of the data was reached,
+// or after a resync, so that the payload in front of it can be written first. used is set to the number of samples decoded.
+size_t decoder_decode_samples(struct decoder*const decoder, size_t count, const uint16_t samples[count], unsigned char out[count + SYMBOL_BYTES_MAX], conv_soft soft[(count + SYMBOL_BYTES_MAX) * 8], size_t*const used){
+  size_t n = 0;
+  size_t i = 0;
+  while(i < count && !decoder->resynced){
+    if(decoder->batch_windows && decoder->state == DECODER_DECODE_DATA && !decoder->fourier.i && decoder->phase >= 0){
+      size_t windows_used = decoder_decode_windows(decoder, count-i, samples+i, out, soft, &n);
+      i += windows_used;
+      if(decoder->state == DECODER_EOF)
+        break;
+      if(windows_used)
+        continue;
+    }
+    int size = decoder_decode(decoder, samples[i++]);
+    if(size > 0)
+      decoder_append_symbol(decoder, out, soft, &n);
+    if(size == DECODER_RET_EOF)
+      break;
+  }
+  *used = i;
+  return n;
+}
+
 #define SIGNAL_STREANGTH 1024
 
-int main(){
-  struct decoder decoder = {
-    .fourier.frequency_count = BIT_COUNT,
+static inline uint16_t read_le16(const unsigned char p[2]){
+  return p[0] | p[1] << 8;
+}
+
+static inline uint32_t read_le32(const unsigned char p[4]){
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t read_le64(const unsigned char p[8]){
+  return read_le32(p) | (uint64_t)read_le32(p+4) << 32;
+}
+
+static inline uint32_t read_le24(const unsigned char p[3]){
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+}
+
+static inline uint16_t pcm_to_sample(int32_t x){
+  float sample = (float)x / 0x80000000lu;
+  return (sample+1)/2*SIGNAL_STREANGTH;
+}
+
+static inline uint16_t float_to_sample(float x){
+  if(!(x > -1)) x = -1; // Also catches NaN
+  if(x > 1) x = 1;
+  return (x+1)/2*SIGNAL_STREANGTH;
+}
+
+#define SAMPLE_FORMATS \
+  X(SAMPLE_S16, "s16", 2) \
+  X(SAMPLE_S24, "s24", 3) \
+  X(SAMPLE_S32, "s32", 4) \
+  X(SAMPLE_F32, "f32", 4)
+
+enum sample_format {
+#define X(ID, NAME, SIZE) ID,
+  SAMPLE_FORMATS
+#undef X
+  SAMPLE_FORMAT_COUNT
+};
+
+static const char*const sample_format_name[] = {
+#define X(ID, NAME, SIZE) [ID] = NAME,
+  SAMPLE_FORMATS
+#undef X
+};
+
+static const uint8_t sample_format_size[] = {
+#define X(ID, NAME, SIZE) [ID] = SIZE,
+  SAMPLE_FORMATS
+#undef X
+};
+
+// Converts the first little endian sample of each of count frames
+static void read_samples(enum sample_format format, const unsigned char* pcm, size_t frame_size, size_t count, uint16_t samples[count]){
+  switch(format){
+    case SAMPLE_S16: {
+      for(size_t i=0; i<count; i++, pcm+=frame_size)
+        samples[i] = pcm_to_sample((uint32_t)read_le16(pcm) << 16);
+    } break;
+    case SAMPLE_S24: {
+      for(size_t i=0; i<count; i++, pcm+=frame_size)
+        samples[i] = pcm_to_sample(read_le24(pcm) << 8);
+    } break;
+    case SAMPLE_S32: {
+      for(size_t i=0; i<count; i++, pcm+=frame_size)
+        samples[i] = pcm_to_sample(read_le32(pcm));
+    } break;
+    case SAMPLE_F32: {
+      for(size_t i=0; i<count; i++, pcm+=frame_size){
+        const uint32_t bits = read_le32(pcm);
+        float x;
+        memcpy(&x, &bits, sizeof(x));
+        samples[i] = float_to_sample(x);
+      }
+    } break;
+    case SAMPLE_FORMAT_COUNT: break;
+  }
+}
+
+// Corrects and writes the frame received so far. Only the last one of a stream is short.
+static void decoder_flush_frame(struct decoder*const decoder, FILE* out){
+  if(!decoder->fec_size)
+    return;
+  const int depth = decoder->fec_depth;
+  const size_t size = rs_frame_data_size(depth, decoder->fec_size);
+  if(size){
+    unsigned char data[RS_DEPTH_MAX * RS_DATA_MAX];
+    const uint8_t*const reliability = decoder->convolutional ? NULL : decoder->fec_reliability;
+    const int failures = rs_frame_decode(depth, decoder->fec_frame, reliability, decoder->fec_size, data);
+    if(failures)
+      fprintf(stderr, "fec: %d blocks of a frame have too many errors to correct\n", failures);
+    fwrite(data, 1, size, out);
+  }else{
+    fprintf(stderr, "fec: dropped an incomplete frame of %u bytes\n", decoder->fec_size);
+  }
+  decoder->fec_size = 0;
+}
+
+// Writes decoded payload. With forward error correction, it's collected into frames, which are written once complete.
+// soft are the soft decisions of its bits, unless it was convolutionally coded.
+static void decoder_write_fec(struct decoder*const decoder, const unsigned char* bytes, const conv_soft* soft, size_t size, FILE* out){
+  const size_t frame_size = decoder->fec_depth * RS_BLOCK_SIZE;
+  if(!frame_size){
+    fwrite(bytes, 1, size, out);
+    return;
+  }
+  while(size){
+    const size_t n = size < frame_size - decoder->fec_size ? size : frame_size - decoder->fec_size;
+    memcpy(decoder->fec_frame + decoder->fec_size, bytes, n);
+    for(size_t i=0; soft && i<n; i++){
+      int least = 127;
+      for(int b=0; b<8; b++){
+        const int sure = abs(soft[i*8+b]);
+        if(sure < least)
+          least = sure;
+      }
+      decoder->fec_reliability[decoder->fec_size + i] = least;
+    }
+    decoder->fec_size += n;
+    bytes += n;
+    if(soft)
+      soft += n * 8;
+    size -= n;
+    if(decoder->fec_size == frame_size)
+      decoder_flush_frame(decoder, out);
+  }
+}
+
+// Decodes the convolutional block received so far. Only the last one of a stream is short.
+static void decoder_flush_block(struct decoder*const decoder, FILE* out){
+  if(!decoder->conv_size)
+    return;
+  const size_t size = conv_block_data_size(decoder->conv_size);
+  if(size){
+    unsigned char data[CONV_DATA_MAX];
+    conv_decode(decoder->conv_block, decoder->conv_size, decoder->conv_symbol_size, data);
+    decoder_write_fec(decoder, data, NULL, size, out);
+  }else{
+    fprintf(stderr, "conv: dropped an incomplete block of %u bytes\n", decoder->conv_size);
+  }
+  decoder->conv_size = 0;
+}
+
+// Convolutionally coded payload is collected into blocks, which are decoded from the soft decisions once complete.
+static void decoder_write(struct decoder*const decoder, const unsigned char* bytes, const conv_soft* soft, size_t size, FILE* out){
+  if(!decoder->convolutional){
+    decoder_write_fec(decoder, bytes, soft, size, out);
+    return;
+  }
+  while(size){
+    const size_t room = CONV_BLOCK_SIZE - decoder->conv_size;
+    const size_t n = size < room ? size : room;
+    memcpy(decoder->conv_block + decoder->conv_size * 8, soft, n * 8);
+    decoder->conv_size += n;
+    soft += n * 8;
+    size -= n;
+    if(decoder->conv_size == CONV_BLOCK_SIZE)
+      decoder_flush_block(decoder, out);
+  }
+}
+
+// d2s resyncs at the start of a frame and of a convolutional block. Whatever is left of one at a resync is what a
+// symbol lost or gained in the signal shifted, and every later frame would be read shifted just as much, so it's dropped.
+static void decoder_realign(struct decoder*const decoder){
+  if(decoder->conv_size)
+    fprintf(stderr, "conv: dropped %u bytes of a block not ending at a resync\n", decoder->conv_size);
+  if(decoder->fec_size)
+    fprintf(stderr, "fec: dropped %u bytes of a frame not ending at a resync\n", decoder->fec_size);
+  decoder->conv_size = 0;
+  decoder->fec_size = 0;
+  decoder->resynced = false;
+}
+
+// Writes what's left of the payload at the end of a stream
+static void decoder_flush(struct decoder*const decoder, FILE* out){
+  decoder_flush_block(decoder, out);
+  decoder_flush_frame(decoder, out);
+}
+
+enum { DECODE_BLOCK_SIZE = 1<<14 };
+
+// Decodes frame_count frames of little endian PCM, taking the first sample of each frame.
+// Returns false once the end of the data was reached. Callers which end the stream early flush the payload themselves.
+static bool decode_pcm(struct decoder*const decoder, enum sample_format format, const unsigned char* pcm, size_t frame_count, size_t frame_size, FILE* out){
+  uint16_t samples[DECODE_BLOCK_SIZE];
+  unsigned char bytes[DECODE_BLOCK_SIZE + SYMBOL_BYTES_MAX];
+  conv_soft soft[(DECODE_BLOCK_SIZE + SYMBOL_BYTES_MAX) * 8];
+  while(frame_count && decoder->state != DECODER_EOF){
+    size_t n = frame_count < DECODE_BLOCK_SIZE ? frame_count : DECODE_BLOCK_SIZE;
+    read_samples(format, pcm, frame_size, n, samples);
+    size_t used;
+    decoder_write(decoder, bytes, soft, decoder_decode_samples(decoder, n, samples, bytes, soft, &used), out);
+    if(decoder->resynced)
+      decoder_realign(decoder);
+    pcm += used * frame_size;
+    frame_count -= used;
+  }
+  if(decoder->state == DECODER_EOF)
+    decoder_flush(decoder, out);
+  return decoder->state != DECODER_EOF;
+}
+
+///////////////////////
+// Parallel decoding //
+///////////////////////
+
+// A recording with periodic resyncs (d2s -r) can be cut at the silence in front of each preamble,
+// and the pieces be decoded independently by their own decoder. Within data, there is always
+// at least the sync signal, which never stays flat for longer than a fraction of a symbol.
+
+enum { THREAD_COUNT_MAX = 256 };
+
+struct segment {
+  pthread_t thread;
+  bool threaded;
+  bool more; // Whether the data continues after this segment
+  struct decoder decoder;
+  enum sample_format format;
+  const unsigned char* pcm;
+  size_t frame_count;
+  size_t frame_size;
+  FILE* out;
+  char* output;
+  size_t output_size;
+};
+
+// Returns where the first run of at least length samples without signal starts,
+// or frame_count if there is none after start.
+static size_t find_silence(enum sample_format format, const unsigned char* pcm, size_t frame_count, size_t frame_size, size_t start, size_t length){
+  size_t run = start;
+  uint16_t min = 0, max = 0;
+  for(size_t i=start; i<frame_count; i++){
+    uint16_t sample;
+    read_samples(format, pcm + i * frame_size, frame_size, 1, &sample);
+    if(sample < min) min = sample;
+    if(sample > max) max = sample;
+    if(i == run || max - min > TIMING_SIGNAL_THRESHOLD){
+      run = i;
+      min = max = sample;
+    }else if(i - run + 1 >= length){
+      return run;
+    }
+  }
+  return frame_count;
+}
+
+static void* decode_segment(void* arg){
+  struct segment*const segment = arg;
+  segment->more = decode_pcm(&segment->decoder, segment->format, segment->pcm, segment->frame_count, segment->frame_size, segment->out);
+  decoder_flush(&segment->decoder, segment->out);
+  fclose(segment->out);
+  return 0;
+}
+
+// The first preamble is decoded up front, to learn the symbol length. The remaining frames are
+// then split into up to thread_count segments at silences at least 1.5 symbols long, each
+// segment continuing half a symbol into the next one.
+// The first segment continues on the current thread, the others decode into memory streams,
+// which are written out in order.
+static void decode_parallel(const struct decoder* template, enum sample_format format, const unsigned char* pcm, size_t frame_count, size_t frame_size, int thread_count){
+  struct decoder decoder = *template;
+  size_t start = 0;
+  while(start < frame_count && decoder.state != DECODER_DECODE_DATA && decoder.state != DECODER_EOF){
+    const size_t n = frame_count - start < SAMPLE_COUNT_MIN ? frame_count - start : SAMPLE_COUNT_MIN;
+    decode_pcm(&decoder, format, pcm + start * frame_size, n, frame_size, stdout);
+    start += n;
+  }
+  if(decoder.state != DECODER_DECODE_DATA){
+    fourier_batch_free(&decoder.batch);
+    fourier_free(&decoder.fourier);
+    return;
+  }
+  const size_t silence = decoder.fourier.sample_count * 3 / 2;
+  const size_t overrun = decoder.fourier.sample_count / 2;
+  struct segment*const segments = calloc(thread_count, sizeof(*segments)); // Too large for the stack with many threads
+  if(!segments){
+    // Decode the rest on this thread then
+    perror("calloc");
+    decode_pcm(&decoder, format, pcm + start * frame_size, frame_count - start, frame_size, stdout);
+    decoder_flush(&decoder, stdout);
+    fourier_batch_free(&decoder.batch);
+    fourier_free(&decoder.fourier);
+    return;
+  }
+  int count = 0;
+  while(start < frame_count && count < thread_count){
+    size_t end = frame_count;
+    if(count+1 < thread_count)
+      end = find_silence(format, pcm, frame_count, frame_size, start + (frame_count - start) / (thread_count - count), silence);
+    struct segment*const segment = &segments[count];
+    memset(segment, 0, sizeof(*segment));
+    memcpy(&segment->decoder, count ? template : &decoder, sizeof(decoder)); // The decoder has const members
+    segment->format = format;
+    segment->pcm = pcm + start * frame_size;
+    // The last symbol window may reach a few samples into the silence
+    segment->frame_count = (end + overrun < frame_count ? end + overrun : frame_count) - start;
+    segment->frame_size = frame_size;
+    if(count){
+      segment->out = open_memstream(&segment->output, &segment->output_size);
+      if(!segment->out){
+        perror("open_memstream");
+      }else{
+        int ret = pthread_create(&segment->thread, 0, decode_segment, segment);
+        if(ret){
+          fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+          fclose(segment->out);
+          free(segment->output);
+        }else segment->threaded = true;
+      }
+    }
+    count++;
+    start = end;
+  }
+  bool more = true;
+  for(int i=0; i<count; i++){
+    struct segment*const segment = &segments[i];
+    if(segment->threaded){
+      pthread_join(segment->thread, 0);
+      if(more)
+        fwrite(segment->output, 1, segment->output_size, stdout);
+      free(segment->output);
+    }else if(more){
+      // The first segment, or one for which no thread could be started
+      segment->more = decode_pcm(&segment->decoder, segment->format, segment->pcm, segment->frame_count, segment->frame_size, stdout);
+      decoder_flush(&segment->decoder, stdout);
+    }
+    more = more && segment->more;
+    fourier_batch_free(&segment->decoder.batch);
+    fourier_free(&segment->decoder.fourier);
+  }
+  free(segments);
+}
+
+///////////////////////
+// WAV file handling //
+///////////////////////
+
+struct wav_format {
+  uint16_t format;
+  uint16_t channels;
+  uint32_t sample_rate;
+  uint16_t block_align;
+  uint16_t bits_per_sample;
+};
+
+enum {
+  WAV_FORMAT_PCM = 1,
+  WAV_FORMAT_FLOAT = 3,
+  WAV_FORMAT_EXTENSIBLE = 0xFFFE, // The actual format tag is at the start of the sub format GUID
+};
+
+// Reads the contents of a fmt chunk
+static const char* wav_parse_fmt(const unsigned char* fmt, size_t size, struct wav_format* format){
+  if(size < 16)
+    return "truncated fmt chunk";
+  *format = (struct wav_format){
+    .format = read_le16(fmt),
+    .channels = read_le16(fmt+2),
+    .sample_rate = read_le32(fmt+4),
+    .block_align = read_le16(fmt+12),
+    .bits_per_sample = read_le16(fmt+14),
   };
-  for(int32_t x; fread(&x, 4, 1, stdin)>0; ){
-    float sample = (float)x / 0x80000000lu;
-    int byte = decoder_decode(&decoder, (sample+1)/2*SIGNAL_STREANGTH);
-    if(byte >= 0){
-      // fprintf(stderr,"%02X\n", byte);
-      putchar(byte);
+  if(format->format == WAV_FORMAT_EXTENSIBLE && size >= 40)
+    format->format = read_le16(fmt+24);
+  return NULL;
+}
+
+// Walks the chunks of a RIFF/WAVE file held in memory and locates the format and data chunks.
+// Returns an error message, or NULL on success.
+static const char* wav_parse(const unsigned char* file, size_t size, struct wav_format* format, const unsigned char** data, size_t* data_size){
+  if(size < 12 || (memcmp(file, "RIFF", 4) && memcmp(file, "RF64", 4)) || memcmp(file+8, "WAVE", 4))
+    return "not a RIFF/WAVE file";
+  bool has_format = false;
+  uint64_t ds64_data_size = UINT64_MAX;
+  for(size_t offset=12; offset <= size && size-offset >= 8; ){
+    const unsigned char* chunk = file + offset;
+    uint64_t chunk_size = read_le32(chunk+4);
+    offset += 8;
+    if(!memcmp(chunk, "ds64", 4)){
+      // RF64 files set the sizes which don't fit to -1, and keep the real ones here
+      if(chunk_size < 24 || size-offset < 24)
+        return "truncated ds64 chunk";
+      ds64_data_size = read_le64(chunk+16);
+    }else if(!memcmp(chunk, "fmt ", 4)){
+      const char* error = wav_parse_fmt(chunk+8, chunk_size < size-offset ? chunk_size : size-offset, format);
+      if(error)
+        return error;
+      has_format = true;
+    }else if(!memcmp(chunk, "data", 4)){
+      if(!has_format)
+        return "data chunk before fmt chunk";
+      if(chunk_size == UINT32_MAX && ds64_data_size != UINT64_MAX)
+        chunk_size = ds64_data_size;
+      // Streamed files don't know their length up front, the size is just a large placeholder then.
+      if(chunk_size > size-offset)
+        chunk_size = size-offset;
+      *data = chunk + 8;
+      *data_size = chunk_size;
+      return NULL;
     }
-    if(byte == DECODER_RET_EOF)
+    // Chunks are padded to an even size, a file may still end without the pad byte of the last one
+    if(chunk_size + (chunk_size & 1) > size-offset)
       break;
+    offset += chunk_size + (chunk_size & 1);
+  }
+  return has_format ? "no data chunk" : "no fmt chunk";
+}
+
+// Returns false for sample formats the decoder can't read
+static bool wav_sample_format(const struct wav_format* format, enum sample_format* sample_format){
+  switch(format->format){
+    case WAV_FORMAT_PCM: {
+      if(format->bits_per_sample == 16){
+        *sample_format = SAMPLE_S16;
+      }else if(format->bits_per_sample == 24){
+        *sample_format = SAMPLE_S24;
+      }else if(format->bits_per_sample == 32){
+        *sample_format = SAMPLE_S32;
+      }else return false;
+    } break;
+    case WAV_FORMAT_FLOAT: {
+      if(format->bits_per_sample != 32)
+        return false;
+      *sample_format = SAMPLE_F32;
+    } break;
+    default: return false;
+  }
+  return format->channels && format->block_align >= sample_format_size[*sample_format];
+}
+
+static int decode_file(struct decoder*const decoder, const char* path, int thread_count){
+  int fd = open(path, O_RDONLY);
+  if(fd == -1){
+    perror(path);
+    return 1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1){
+    perror(path);
+    close(fd);
+    return 1;
+  }
+  size_t size = st.st_size;
+  const unsigned char* file = size ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if(file == MAP_FAILED){
+    if(size) perror(path);
+    else fprintf(stderr, "%s: empty file\n", path);
+    return 1;
+  }
+  posix_madvise((void*)file, size, POSIX_MADV_SEQUENTIAL);
+  struct wav_format format = {0};
+  const unsigned char* data;
+  size_t data_size;
+  enum sample_format sample_format = SAMPLE_S32;
+  const char* error = wav_parse(file, size, &format, &data, &data_size);
+  if(!error && !wav_sample_format(&format, &sample_format))
+    error = "unsupported sample format, expected 16, 24 or 32bit integer, or 32bit float PCM";
+  if(error){
+    fprintf(stderr, "%s: %s\n", path, error);
+    munmap((void*)file, size);
+    return 1;
+  }
+  decoder->sample_rate = format.sample_rate;
+  if(thread_count > 1){
+    decode_parallel(decoder, sample_format, data, data_size / format.block_align, format.block_align, thread_count);
+  }else{
+    decode_pcm(decoder, sample_format, data, data_size / format.block_align, format.block_align, stdout);
+    decoder_flush(decoder, stdout);
+  }
+  munmap((void*)file, size);
+  return 0;
+}
+
+// Streams may be pipes, so they can't seek. Returns false if the stream ended early.
+static bool stream_skip(FILE* in, uint64_t size){
+  unsigned char buffer[1<<12];
+  while(size){
+    const size_t n = size < sizeof(buffer) ? size : sizeof(buffer);
+    if(fread(buffer, 1, n, in) != n)
+      return false;
+    size -= n;
+  }
+  return true;
+}
+
+// Reads the chunks of a RIFF/WAVE or RF64 stream following the initial magic, up to the samples in the data chunk.
+// Unknown chunks are skipped. The samples are read until the end of the stream, not just the data chunk,
+// a streamed file doesn't know its length up front. Returns an error message, or NULL on success.
+static const char* wav_read_header(FILE* in, struct wav_format* format){
+  unsigned char header[8];
+  if(fread(header, 1, 8, in) != 8 || memcmp(header+4, "WAVE", 4))
+    return "not a RIFF/WAVE file";
+  bool has_format = false;
+  while(fread(header, 1, 8, in) == 8){
+    const uint32_t chunk_size = read_le32(header+4);
+    const uint64_t padded_size = chunk_size + (uint64_t)(chunk_size & 1); // Chunks are padded to an even size
+    if(!memcmp(header, "fmt ", 4)){
+      unsigned char fmt[40];
+      const size_t n = chunk_size < sizeof(fmt) ? chunk_size : sizeof(fmt);
+      if(fread(fmt, 1, n, in) != n || !stream_skip(in, padded_size - n))
+        return "truncated fmt chunk";
+      const char* error = wav_parse_fmt(fmt, n, format);
+      if(error)
+        return error;
+      has_format = true;
+    }else if(!memcmp(header, "data", 4)){
+      return has_format ? NULL : "data chunk before fmt chunk";
+    }else if(!stream_skip(in, padded_size)){
+      break;
+    }
+  }
+  return has_format ? "no data chunk" : "no fmt chunk";
+}
+
+// Anything not starting with RIFF or RF64 is taken to be raw samples of the given format.
+static int decode_stream(struct decoder*const decoder, enum sample_format sample_format, FILE* in){
+  static unsigned char pcm[DECODE_BLOCK_SIZE * 4];
+  size_t frame_size = sample_format_size[sample_format];
+  size_t size = fread(pcm, 1, 4, in);
+  if(size == 4 && (!memcmp(pcm, "RIFF", 4) || !memcmp(pcm, "RF64", 4))){
+    struct wav_format format = {0};
+    const char* error = wav_read_header(in, &format);
+    if(!error && !wav_sample_format(&format, &sample_format))
+      error = "unsupported sample format, expected 16, 24 or 32bit integer, or 32bit float PCM";
+    if(error){
+      fprintf(stderr, "stdin: %s\n", error);
+      return 1;
+    }
+    frame_size = format.block_align; // Only the first channel is decoded
+    decoder->sample_rate = format.sample_rate;
+    size = 0;
+  }
+  while(true){
+    const size_t n = fread(pcm+size, 1, sizeof(pcm)-size, in);
+    size += n;
+    const size_t frame_count = size / frame_size;
+    if(!frame_count || !decode_pcm(decoder, sample_format, pcm, frame_count, frame_size, stdout) || !n)
+      break;
+    size -= frame_count * frame_size; // A partial frame is left over with 24bit samples
+    memmove(pcm, pcm + frame_count * frame_size, size);
+  }
+  decoder_flush(decoder, stdout);
+  return 0;
+}
+
+int main(int argc, char* argv[]){
+  static struct decoder decoder = {
+    .fourier.frequency_count = BIT_COUNT,
+  };
+  bool allow_simd = true;
+  int thread_count = 1;
+  enum sample_format sample_format = SAMPLE_S32;
+  for(int opt; (opt=getopt(argc, argv, "be:f:j:S")) != -1; ){
+    switch(opt){
+      case 'b': decoder.batch_windows = true; break;
+      case 'f': {
+        for(sample_format=0; sample_format<SAMPLE_FORMAT_COUNT; sample_format++)
+          if(!strcmp(optarg, sample_format_name[sample_format]))
+            break;
+        if(sample_format == SAMPLE_FORMAT_COUNT)
+          goto usage;
+      } break;
+      case 'j': {
+        char* end;
+        long n = strtol(optarg, &end, 10);
+        if(*end || n < 1 || n > THREAD_COUNT_MAX){
+          fprintf(stderr, "%s: the thread count must be between 1 and %d\n", argv[0], THREAD_COUNT_MAX);
+          return 1;
+        }
+        thread_count = n;
+      } break;
+      case 'S': allow_simd = false; break;
+      case 'e': {
+        if(!strcmp(optarg, "dft")){
+          decoder.fourier.engine = FOURIER_DFT;
+        }else if(!strcmp(optarg, "goertzel")){
+          decoder.fourier.engine = FOURIER_GOERTZEL;
+        }else if(!strcmp(optarg, "fft")){
+          decoder.fourier.engine = FOURIER_FFT;
+        }else goto usage;
+      } break;
+      default: goto usage;
+    }
+  }
+  if(argc - optind > 1)
+    goto usage;
+  if(thread_count > 1 && optind == argc){
+    fprintf(stderr, "%s: -j needs a file to split up, it can't be used with stdin\n", argv[0]);
+    return 1;
+  }
+  fourier_select_kernels(allow_simd);
+  conv_select_kernels(allow_simd);
+  rs_init();
+  int ret = 0;
+  if(optind < argc){
+    ret = decode_file(&decoder, argv[optind], thread_count);
+  }else{
+    ret = decode_stream(&decoder, sample_format, stdin);
   }
+  fourier_batch_free(&decoder.batch);
+  fourier_free(&decoder.fourier);
+  return ret;
+usage:
+  fprintf(stderr,
+    "usage: %s [-b] [-e dft|goertzel|fft] [-f s16|s24|s32|f32] [-j threads] [-S] [file.wav] > file\n"
+    "  Decodes stdin, or maps the given WAV file into memory\n"
+    "  -b  correlate batches of whole data symbol windows at once\n"
+    "  -e  frequency detection engine, defaults to dft. fft is faster with many carriers\n"
+    "  -f  sample format of raw samples on stdin, defaults to s32\n"
+    "  -j  decode the parts between the resyncs of the file in parallel\n"
+    "  -S  don't use SIMD kernels, even if the CPU supports them\n",
+    argv[0]
+  );
+  return 1;
 }